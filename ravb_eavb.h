@@ -2,6 +2,7 @@
 #define __RAVB_EAVB_H__
 
 #define EAVB_ENTRYVECNUM (2)
+#define EAVB_ENTRYVECNUM_MAX (8)
 #define EAVB_TXSTREAMNUM (16)
 #define EAVB_RXSTREAMNUM (16)
 
@@ -15,6 +16,36 @@ struct eavb_entry {
 	struct eavb_entryvec vec[EAVB_ENTRYVECNUM];
 };
 
+/**
+ * scatter-gather entry
+ *
+ * Each of the vecnum vectors becomes one descriptor of the frame, so a
+ * frame can be built from separate header and payload buffers.
+ */
+struct eavb_entry_sg {
+	uint32_t seq_no;
+	uint32_t vecnum;
+	struct eavb_entryvec vec[EAVB_ENTRYVECNUM_MAX];
+};
+
+/**
+ * timed entry (TX only)
+ *
+ * The entry is held in the driver until launch_time, given in CLOCK_TAI
+ * nanoseconds, less the launch_lead_usec module parameter. A launch_time
+ * of 0 sends the entry at once.
+ */
+struct eavb_entry_timed {
+	uint64_t launch_time;
+	struct eavb_entry_sg entry;
+};
+
+enum eavb_entryformat {
+	EAVB_ENTRYFORMAT_DEFAULT,	/* struct eavb_entry */
+	EAVB_ENTRYFORMAT_SG,		/* struct eavb_entry_sg */
+	EAVB_ENTRYFORMAT_TIMED,		/* struct eavb_entry_timed */
+};
+
 enum eavb_streamclass {
 	EAVB_CLASSB,
 	EAVB_CLASSA,
@@ -30,6 +61,7 @@ struct eavb_cbsparam {
 	uint32_t loCredit;
 };
 
+/* as an io_uring command, only with IORING_SETUP_SQE128 */
 struct eavb_txparam {
 	struct eavb_cbsparam cbs;
 };
@@ -49,7 +81,30 @@ enum eavb_block {
 };
 
 enum eavb_optionid {
-	EAVB_OPTIONID_BLOCKMODE = 1
+	EAVB_OPTIONID_BLOCKMODE = 1,
+	EAVB_OPTIONID_ENTRYFORMAT = 2,	/* read/write and ring entry format */
+	EAVB_OPTIONID_COMPLETION = 3,	/* enum eavb_completion */
+	EAVB_OPTIONID_PRIORITY = 4,	/* 0 to EAVB_PRIORITY_MAX, TX only */
+	EAVB_OPTIONID_SHAPER = 5,	/* per stream shaping on/off, TX only */
+	EAVB_OPTIONID_PACING = 6,	/* one entry per class interval, TX only */
+};
+
+/**
+ * Stream queues of a higher priority are served first on the same
+ * hwqueue. Stream queues of the same priority share the hwqueue in
+ * proportion to their reserved bandwidth.
+ */
+#define EAVB_PRIORITY_MAX (7)
+
+/**
+ * EAVB_COMPLETION_COUNT acknowledges completed entries by count only.
+ * read() returns the size of the completed entries without filling the
+ * buffer, and the ring advances the completion tail without writing
+ * completion entries.
+ */
+enum eavb_completion {
+	EAVB_COMPLETION_ENTRY,
+	EAVB_COMPLETION_COUNT,
 };
 
 struct eavb_option {
@@ -57,12 +112,75 @@ struct eavb_option {
 	uint32_t param;
 };
 
+/**
+ * TX descriptor template
+ *
+ * Entries written to a stream queue with a template only supply the
+ * buffer addresses, the frame layout is taken from the template.
+ */
+struct eavb_desctemplate {
+	uint32_t vecnum;	/* 0 removes the template */
+	uint32_t len[EAVB_ENTRYVECNUM_MAX];
+};
+
+/**
+ * gate control list of a TX hwqueue
+ *
+ * From base_time on, each cycle_time the entries are run in order, each
+ * opening the stream queue priorities set in gate_mask for interval ns.
+ * The last entry lasts until the end of the cycle. All gates are open
+ * before base_time and while num is 0. Times are CLOCK_TAI ns. A list
+ * never opening the priority of an open stream queue is refused, and
+ * a stream queue being closed sends its entries whatever its gate.
+ */
+#define EAVB_GCL_MAX (16)
+
+struct eavb_gate_entry {
+	uint32_t gate_mask;	/* bit n opens priority n */
+	uint32_t interval;
+};
+
+struct eavb_gcl {
+	uint64_t base_time;
+	uint32_t cycle_time;
+	uint32_t num;		/* 0 removes the list */
+	struct eavb_gate_entry entry[EAVB_GCL_MAX];
+};
+
 struct eavb_entrynum {
 	uint32_t accepted;
 	uint32_t processed;
 	uint32_t completed;
 };
 
+/**
+ * shared memory submission/completion ring
+ */
+#define EAVB_RING_MMAP_OFFSET	(0)
+
+enum eavb_ringflags {
+	EAVB_RING_NEED_WAKEUP = 0x00000001,
+};
+
+struct eavb_ringidx {
+	uint32_t head;		/* consumer index */
+	uint32_t tail;		/* producer index */
+};
+
+struct eavb_ring {
+	struct eavb_ringidx sq;	/* user produces, driver consumes */
+	struct eavb_ringidx cq;	/* driver produces, user consumes */
+	uint32_t flags;		/* enum eavb_ringflags */
+	uint32_t entries;	/* number of entries each ring */
+};
+
+struct eavb_ringparam {
+	uint32_t entries;	/* output: number of entries each ring */
+	uint32_t sq_off;	/* output: offset of submission entries */
+	uint32_t cq_off;	/* output: offset of completion entries */
+	uint32_t mmap_size;	/* output: size of the ring area */
+};
+
 #ifdef __KERNEL__
 /**
  * Streaming driver I/F function for kernel driver
@@ -105,6 +223,14 @@ struct ravb_streaming_kernel_if {
 	long (*get_entrynum)(void *handle, struct eavb_entrynum *entrynum);
 	long (*get_linkspeed)(void *handle);
 	long (*blocking_cancel)(void *handle);
+	int (*read_sg)(void *handle, struct eavb_entry_sg *buf,
+		       unsigned int num);
+	int (*write_sg)(void *handle, struct eavb_entry_sg *buf,
+			unsigned int num);
+	long (*set_template)(void *handle, struct eavb_desctemplate *tmpl);
+	long (*get_template)(void *handle, struct eavb_desctemplate *tmpl);
+	long (*set_gcl)(void *handle, struct eavb_gcl *gcl);
+	long (*get_gcl)(void *handle, struct eavb_gcl *gcl);
 };
 
 extern int ravb_streaming_open_stq_kernel(
@@ -143,6 +269,14 @@ struct eavb_avbtool_ringparam {
 	uint32_t tx_pending;
 };
 
+/* for configuring interrupt coalescing of a hwqueue */
+struct eavb_avbtool_coalesce {
+	uint32_t queue;			/* hwqueue, enum AVB_DEVNAME */
+	uint32_t coalesce_usecs;	/* interrupt timeout, 0 for none */
+	uint32_t max_coalesced_frames;	/* frames per interrupt */
+	uint32_t use_adaptive_coalesce;	/* follow the completion rate */
+};
+
 /* for configuring number of network channel */
 struct eavb_avbtool_channels {
 	uint32_t max_rx;
@@ -193,6 +327,32 @@ struct eavb_dma_alloc {
 	unsigned int mmap_size;
 };
 
+/**
+ *for mappool/unmappool
+ */
+struct eavb_dma_pool {
+	uint32_t dma_paddr;	/* output: base address of the pool */
+	uint32_t size;		/* input: requested size, output: pool size */
+};
+
+/**
+ *for attachdmabuf/detachdmabuf/exportdmabuf
+ */
+struct eavb_dmabuf {
+	int32_t fd;		/* input(attach), output(export) */
+	uint32_t dma_paddr;	/* output(attach), input(detach, export) */
+	uint32_t size;		/* output: size of the buffer */
+};
+
+/**
+ *for poolalloc/poolfree
+ */
+struct eavb_dma_chunk {
+	uint32_t pool_paddr;	/* input: base address of the pool */
+	uint32_t size;		/* input: size of the chunk */
+	uint32_t dma_paddr;	/* output(alloc), input(free): chunk address */
+};
+
 #define EAVB_MAGIC 'R'
 
 #define EAVB_SETTXPARAM     _IOW(EAVB_MAGIC, 3, struct eavb_txparam)
@@ -202,13 +362,23 @@ struct eavb_dma_alloc {
 #define EAVB_GETCBSINFO     _IOR(EAVB_MAGIC, 7, struct eavb_cbsinfo)
 #define EAVB_SETOPTION      _IOW(EAVB_MAGIC, 8, struct eavb_option)
 #define EAVB_GETOPTION      _IOR(EAVB_MAGIC, 9, struct eavb_option)
+#define EAVB_SETUPRING      _IOR(EAVB_MAGIC, 10, struct eavb_ringparam)
+#define EAVB_ENTERRING      _IO(EAVB_MAGIC, 11)
+#define EAVB_WAITRING       _IO(EAVB_MAGIC, 12) /* io_uring command only, waits from 6.7 */
+#define EAVB_SETTEMPLATE    _IOW(EAVB_MAGIC, 20, struct eavb_desctemplate)
+#define EAVB_GETTEMPLATE    _IOR(EAVB_MAGIC, 21, struct eavb_desctemplate)
+#define EAVB_SETGCL         _IOW(EAVB_MAGIC, 22, struct eavb_gcl)
+#define EAVB_GETGCL         _IOR(EAVB_MAGIC, 23, struct eavb_gcl)
 
 /* for avbtool */
 #define EAVB_AVBTOOL_OFFSET (0x20)
 #define EAVB_AVBTOOL_NR(n) (EAVB_AVBTOOL_OFFSET+(n))
 
 #define EAVB_GDRVINFO       _IOR(EAVB_MAGIC,  EAVB_AVBTOOL_NR(0x03), struct eavb_avbtool_drvinfo)
+#define EAVB_GCOALESCE      _IOWR(EAVB_MAGIC, EAVB_AVBTOOL_NR(0x0e), struct eavb_avbtool_coalesce)
+#define EAVB_SCOALESCE      _IOW(EAVB_MAGIC,  EAVB_AVBTOOL_NR(0x0f), struct eavb_avbtool_coalesce)
 #define EAVB_GRINGPARAM     _IOR(EAVB_MAGIC,  EAVB_AVBTOOL_NR(0x10), struct eavb_avbtool_ringparam)
+#define EAVB_SRINGPARAM     _IOW(EAVB_MAGIC,  EAVB_AVBTOOL_NR(0x11), struct eavb_avbtool_ringparam)
 #define EAVB_GSSET_INFO     _IOWR(EAVB_MAGIC, EAVB_AVBTOOL_NR(0x37), struct eavb_avbtool_sset_info)
 #define EAVB_GSTRINGS       _IOWR(EAVB_MAGIC, EAVB_AVBTOOL_NR(0x1b), struct eavb_avbtool_gstrings)
 #define EAVB_GSTATS         _IOR(EAVB_MAGIC,  EAVB_AVBTOOL_NR(0x1d), struct eavb_avbtool_stats)
@@ -217,5 +387,12 @@ struct eavb_dma_alloc {
 /* for debug or test */
 #define EAVB_MAPPAGE        _IOR(EAVB_MAGIC, 1, struct eavb_dma_alloc)
 #define EAVB_UNMAPPAGE      _IOW(EAVB_MAGIC, 2, struct eavb_dma_alloc)
+#define EAVB_MAPPOOL        _IOWR(EAVB_MAGIC, 13, struct eavb_dma_pool)
+#define EAVB_UNMAPPOOL      _IOW(EAVB_MAGIC, 14, struct eavb_dma_pool)
+#define EAVB_POOLALLOC      _IOWR(EAVB_MAGIC, 15, struct eavb_dma_chunk)
+#define EAVB_POOLFREE       _IOW(EAVB_MAGIC, 16, struct eavb_dma_chunk)
+#define EAVB_ATTACHDMABUF   _IOWR(EAVB_MAGIC, 17, struct eavb_dmabuf)
+#define EAVB_DETACHDMABUF   _IOW(EAVB_MAGIC, 18, struct eavb_dmabuf)
+#define EAVB_EXPORTDMABUF   _IOWR(EAVB_MAGIC, 19, struct eavb_dmabuf)
 
 #endif /* __RAVB_EAVB_H__ */
@@ -63,6 +63,7 @@
 #define pr_fmt(fmt) KBUILD_MODNAME "/" fmt
 
 #include <linux/init.h>
+#include <linux/version.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/interrupt.h>
@@ -93,8 +94,8 @@ module_param(debug, bool, 0440);
  *  /proc/avb/hw/
  *
  *  /proc/avb/hw/descriptors
- *  Queue  Type  Size    Used   Free   Min.Free  State
- *  S15      Tx  9999    9999   9999       9999  xxxxxxxx
+ *  Queue  Type  Size    Used   Free   Min.Free  High   Low   State
+ *  S15      Tx  9999    9999   9999       9999  9999   9999  xxxxxxxx
  *
  *  /proc/avb/hw/filters
  *  Stream Type Queue Chno  Filter
@@ -547,7 +548,8 @@ static int stats_show_network_phy(struct seq_file *m, void *v)
 	return 0;
 }
 
-#define HW_DESCRIPTORS_FORMAT "%-3s      %2s  %4u    %4u   %4u       %4u  %s\n"
+#define HW_DESCRIPTORS_FORMAT \
+	"%-3s      %2s  %4u    %4u   %4u       %4u  %4u   %4u  %s%s\n"
 
 /**
  * @brief  Show formatted Driver/HW Descriptor statistics
@@ -564,10 +566,13 @@ static int stats_show_hw_descriptors(struct seq_file *m, void *v)
 
 	/**
 	 * /proc/avb/hw/descriptors
-	 * Queue  Type  Size    Used   Free   Min.Free  State
-	 * S15      Tx  9999    9999   9999       9999  xxxxxxxx
+	 * Queue  Type  Size    Used   Free   Min.Free  High   Low   State
+	 * S15      Tx  9999    9999   9999       9999  9999   9999  xxxxxxxx
+	 *
+	 * High and Low are the ring fill watermarks in descriptors, 0 if
+	 * not set, and a draining queue is above High until down to Low.
 	 */
-	seq_puts(m, "Queue  Type  Size    Used   Free   Min.Free  State\n");
+	seq_puts(m, "Queue  Type  Size    Used   Free   Min.Free  High   Low   State\n");
 
 	/* Show best effort/network control tx queue */
 	for (h = 0; h < 2; h++)
@@ -579,7 +584,9 @@ static int stats_show_hw_descriptors(struct seq_file *m, void *v)
 			   priv->cur_tx[h] - priv->dirty_tx[h],
 			   priv->num_tx_ring[h] - (priv->cur_tx[h] - priv->dirty_tx[h]),
 			   0, /* reserved */
-			   (priv->cur_tx[h] - priv->dirty_tx[h]) ? "active" : "idle");
+			   0, 0,
+			   (priv->cur_tx[h] - priv->dirty_tx[h]) ? "active" : "idle",
+			   "");
 
 	/* Show streaming tx queue */
 	for (h = 0; h < ARRAY_SIZE(stp->hwqueueInfoTable); h++) {
@@ -595,7 +602,10 @@ static int stats_show_hw_descriptors(struct seq_file *m, void *v)
 			   hwq->ringsize - hwq->remain,
 			   hwq->remain,
 			   hwq->minremain,
-			   query_avb_state(hwq->state));
+			   hwq->ring_high,
+			   hwq->ring_high ? min(hwq->ring_low, hwq->ring_high) : 0,
+			   query_avb_state(hwq->state),
+			   hwq->draining ? " draining" : "");
 	}
 
 	/* Show best effort/network control rx queue */
@@ -608,7 +618,9 @@ static int stats_show_hw_descriptors(struct seq_file *m, void *v)
 			   priv->cur_rx[h] - priv->dirty_rx[h],
 			   priv->num_rx_ring[h] - (priv->cur_rx[h] - priv->dirty_rx[h]),
 			   0, /* reserved */
-			   (priv->cur_rx[h] - priv->dirty_rx[h]) ? "active" : "idle");
+			   0, 0,
+			   (priv->cur_rx[h] - priv->dirty_rx[h]) ? "active" : "idle",
+			   "");
 
 	/* Show streaming rx queue */
 	for (h = 0; h < ARRAY_SIZE(stp->hwqueueInfoTable); h++) {
@@ -624,7 +636,9 @@ static int stats_show_hw_descriptors(struct seq_file *m, void *v)
 			   hwq->ringsize - hwq->remain,
 			   hwq->remain,
 			   hwq->minremain,
-			   query_avb_state(hwq->state));
+			   0, 0,
+			   query_avb_state(hwq->state),
+			   "");
 	}
 
 	return 0;
@@ -739,6 +753,43 @@ static int stats_show_driver_queues(struct seq_file *m, void *v)
 	return 0;
 }
 
+/**
+ * @brief  Show interrupt to wakeup latency histograms
+ */
+static int stats_show_driver_latency(struct seq_file *m, void *v)
+{
+	struct ravb_proc_info_t *info = &ravb_proc_info;
+	struct streaming_private *stp = info->stp;
+	struct hwqueue_info *hwq;
+	char label[8];
+	int h, b;
+
+	/**
+	 * /proc/avb/driver/latency
+	 * Queue     <1us     <2us ...   <512us     more
+	 * avb_tx0   9999     9999 ...     9999     9999
+	 *
+	 * Count of reader wakeups by the time since the interrupt
+	 * reporting their completions, in usec.
+	 */
+	seq_puts(m, "Queue   ");
+	for (b = 0; b < RAVB_LATENCY_BUCKETS - 1; b++) {
+		snprintf(label, sizeof(label), "<%uus", 1u << b);
+		seq_printf(m, " %8s", label);
+	}
+	seq_printf(m, " %8s\n", "more");
+
+	for (h = 0; h < ARRAY_SIZE(stp->hwqueueInfoTable); h++) {
+		hwq = &stp->hwqueueInfoTable[h];
+		seq_printf(m, "%-8s", hwq_name(hwq));
+		for (b = 0; b < RAVB_LATENCY_BUCKETS; b++)
+			seq_printf(m, " %8llu", hwq->wakeup_latency[b]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
 /**
  * @brief  Show formatted driver userpages
  */
@@ -750,7 +801,11 @@ static int stats_show_driver_userpages(struct seq_file *m, void *v)
 
 static int stats_proc_open(struct inode *inode, struct file *file)
 {
+#if KERNEL_VERSION(5, 17, 0) <= LINUX_VERSION_CODE
+	return single_open(file, pde_data(inode), NULL);
+#else
 	return single_open(file, PDE_DATA(inode), NULL);
+#endif
 }
 
 static const struct proc_ops stats_proc_fops = {
@@ -847,6 +902,7 @@ static const struct stats_proc_entry proc_data_hw[] = {
 static const struct stats_proc_entry proc_data_driver[] = {
 	{ "queues", stats_show_driver_queues, true },
 	{ "userpages", stats_show_driver_userpages, true },
+	{ "latency", stats_show_driver_latency, true },
 };
 
 static struct {
@@ -71,6 +71,9 @@
 		((RAVB_STQUEUE_TXNUM > RAVB_STQUEUE_RXNUM) ? \
 	 RAVB_STQUEUE_TXNUM : RAVB_STQUEUE_RXNUM)
 
+/* number of strict priority levels among stream queues of a hwqueue */
+#define RAVB_STQUEUE_PRIO_NUM (EAVB_PRIORITY_MAX + 1)
+
 /**
  * Number of HW queue resource which is
  * under control AVB streaming driver
@@ -84,9 +87,44 @@
 /* ringsize of descriptor chain */
 #define RAVB_RINGSIZE (256)
 
+/* smallest ring size settable at runtime, a few entries of full vectors */
+#define RAVB_RINGSIZE_MIN (4 * EAVB_ENTRYVECNUM_MAX)
+/* longest wait for a hwqueue to drain before reconfiguring it */
+#define RAVB_QUIESCE_TIMEOUT_MSEC (1000)
+
 /* maximum number of entry each streaming device */
 #define RAVB_ENTRY_THRETH (RAVB_RINGSIZE)
 
+/* DRR quantum of a stream queue reserving the whole bandwidth */
+#define RAVB_DRR_QUANTUM_FULL (8 * ETH_FRAME_LEN)
+/* DRR quantum of a stream queue without reservation */
+#define RAVB_DRR_QUANTUM_MIN (ETH_FRAME_LEN)
+
+/* preamble, FCS and interframe gap counted by SRP on each frame */
+#define RAVB_SHAPER_FRAME_OVERHEAD (24)
+/* shaper burst of a stream queue without hiCredit, as in CBS */
+#define RAVB_SHAPER_DEPTH_MIN (2012)
+/* largest shaper burst, a few full frames whatever the CBS parameters */
+#define RAVB_SHAPER_DEPTH_MAX (8 * ETH_FRAME_LEN)
+
+/* class measurement intervals paced stream queues send one entry in */
+#define RAVB_PACING_INTERVAL_CLASSA (125 * NSEC_PER_USEC)
+#define RAVB_PACING_INTERVAL_CLASSB (250 * NSEC_PER_USEC)
+
+/* all stream queue priorities open, as without a gate control list */
+#define RAVB_GATE_ALL_OPEN GENMASK(RAVB_STQUEUE_PRIO_NUM - 1, 0)
+/* shortest gate interval, bounds the gate timer rate */
+#define RAVB_GCL_INTERVAL_MIN (NSEC_PER_USEC)
+
+/* longest busy poll spin, the hwqueue task holds its CPU meanwhile */
+#define RAVB_BUSY_POLL_USEC_MAX (2 * USEC_PER_MSEC)
+
+/* adaptive interrupt coalescing sample period */
+#define RAVB_COALESCE_SAMPLE_NSEC (10 * NSEC_PER_MSEC)
+
+/* interrupt to wakeup latency buckets, under 1, 2, 4 .. 512 usec and more */
+#define RAVB_LATENCY_BUCKETS (11)
+
 /* CBS bandwidth acceptable limit */
 #define RAVB_CBS_BANDWIDTH_LIMIT \
 	((u64)((U32_MAX * 750000ull) / 1000000ull)) /* 75% */
@@ -116,20 +154,51 @@ enum DESC_DIE_DPF {
 	DESC_DIE_DPF_15
 };
 
+/* sub-allocation unit of multi-page user pools */
+#define RAVB_USERPOOL_CHUNK (SMP_CACHE_BYTES)
+/* largest multi-page user pool */
+#define RAVB_USERPOOL_SIZE_MAX (16 * 1024 * 1024)
+
+/* DMA address range handed to userspace, indexed by stp->regions */
+struct ravb_dma_region {
+	struct rb_node node;
+	dma_addr_t dma;
+	size_t size;
+	struct stqueue_info *owner; /* NULL if shared by all stream queues */
+	bool dmabuf;
+};
+
 struct ravb_user_page {
 	struct page *page;
-	dma_addr_t page_dma;
+	struct ravb_dma_region region;
+	unsigned long *chunk_map; /* multi-page pool only */
+	struct kref ref; /* held by the owner list and exported dma-bufs */
 	struct list_head list;
 };
 
+struct ravb_user_dmabuf {
+	struct dma_buf *dmabuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	struct ravb_dma_region region;
+	struct list_head list;
+};
+
+/* pre-encoded TX descriptors of a fixed-format stream */
+struct ravb_desc_template {
+	int vecsize; /* 0 if no template */
+	struct ravb_desc pre_enc[EAVB_ENTRYVECNUM_MAX];
+};
+
 struct stream_entry {
 	int vecsize;
 	int total_bytes;
 	int errors;
-	struct ravb_desc *descs[EAVB_ENTRYVECNUM];
-	struct ravb_desc pre_enc[EAVB_ENTRYVECNUM];
-	dma_addr_t dma_descs[EAVB_ENTRYVECNUM];
-	struct eavb_entry msg;
+	struct ravb_desc *descs[EAVB_ENTRYVECNUM_MAX];
+	struct ravb_desc pre_enc[EAVB_ENTRYVECNUM_MAX];
+	dma_addr_t dma_descs[EAVB_ENTRYVECNUM_MAX];
+	struct eavb_entry_sg msg;
+	u64 launch_time; /* CLOCK_TAI ns, 0 if not gated */
 
 	struct stqueue_info *stq;
 	struct list_head list;
@@ -142,10 +211,77 @@ enum AVB_EVENT {
 	AVB_EVENT_TXINT   = 0x00000010,
 	AVB_EVENT_RXINT   = 0x00000020,
 	AVB_EVENT_TIMEOUT = 0x00000040,
+	AVB_EVENT_LAUNCH  = 0x00000080,
 	AVB_EVENT_UNLOAD  = 0x00000100,
+	AVB_EVENT_GATE    = 0x00000200,
+};
+
+/**
+ * per stream token bucket, in its virtual scheduling form: tat is the
+ * CLOCK_TAI time the bucket becomes full again
+ */
+struct token_bucket {
+	bool enabled;
+	bool blocked; /* head entry found nonconforming */
+	u64 tat;
+};
+
+/* gate control list state of a hwqueue */
+struct gate_info {
+	struct eavb_gcl gcl;
+	struct hrtimer timer;
+	u64 cycle_start;
+	u64 entry_end;
+	int index; /* running entry, -1 before base_time */
+	u32 mask; /* open priority levels */
+};
+
+/* class interval pacing of a stream queue */
+struct pacing_info {
+	bool enabled;
+	u64 next; /* CLOCK_TAI time of the next slot, 0 if none yet */
+};
+
+/* interrupt coalescing state of a hwqueue */
+struct coalesce_info {
+	bool adaptive; /* level chosen from the completion rate */
+	int level;
+	u64 sample_start;
+	u64 interrupts; /* interrupt count at sample_start */
+	u32 completed; /* frames completed since sample_start */
+	u32 frame_rate; /* frames per second over the last sample */
+	u32 irq_rate; /* interrupts per second over the last sample */
+	int frames; /* frames per interrupt in use */
+	int usec; /* interrupt timeout in use, 0 for none */
+	int param_frames; /* irq module parameters last applied */
+	int param_usec;
+};
+
+struct hwqueue_info;
+struct stqueue_info;
+struct ravb_encode_pass;
+
+/* stream queue scheduler of a hwqueue */
+struct ravb_sched_ops {
+	const char *name;
+	void (*attach)(struct hwqueue_info *hwq, struct stqueue_info *stq);
+	void (*detach)(struct hwqueue_info *hwq, struct stqueue_info *stq);
+	void (*enqueue)(struct hwqueue_info *hwq, struct stqueue_info *stq);
+	struct stqueue_info *(*dequeue)(struct hwqueue_info *hwq,
+					struct ravb_encode_pass *ep);
+	void (*sent)(struct hwqueue_info *hwq, struct ravb_encode_pass *ep,
+		     struct stqueue_info *stq, u32 bytes);
+	void (*remove)(struct hwqueue_info *hwq, struct ravb_encode_pass *ep,
+		       struct stqueue_info *stq);
 };
 
 struct schedule_info {
+	u32 deficit; /* bytes left to send in this DRR round */
+	bool replenish; /* credit a quantum when reaching the head */
+	/* burst sent in encode pass number pass */
+	u32 pass;
+	u32 burst_entries;
+	u32 burst_bytes;
 };
 
 enum AVB_STATE {
@@ -190,6 +326,18 @@ struct driver_stats {
 	/* current entries in a complete queue for Rx/Tx */
 	u64 rx_entry_complete;
 	u64 tx_entry_complete;
+	/* vectors requested and dma_sync calls issued for cache maintenance */
+	u64 cachesync_ranges;
+	u64 cachesync_calls;
+	/* encode passes that filled the ring before serving this stream */
+	u64 starved;
+	/* entries handed to the hardware after their launch time */
+	u64 deadline_misses;
+	/* entries held back by the per stream shaper */
+	u64 nonconforming;
+	/* busy polls that found a completion, and that ran out of budget */
+	u64 poll_hits;
+	u64 poll_misses;
 };
 
 /* structure of stream queue */
@@ -200,13 +348,23 @@ struct stqueue_info {
 	int qno;
 
 	struct eavb_entrynum entrynum;
+	int preparing; /* writers preparing entries outside hwq->sem */
 	enum eavb_block blockmode;
+	enum eavb_completion completion;
 	struct eavb_cbsparam cbs;
 	struct schedule_info schedInfo;
+	u32 priority;
+	struct token_bucket shaper;
+	struct pacing_info pacing;
 
 	struct list_head entryWaitQueue;
 	struct list_head entryLogQueue;
+	struct list_head entryFreeQueue;
+	struct stream_entry *entryPool;
+	spinlock_t entryLock; /* protects entryFreeQueue and tmpl */
+	struct ravb_desc_template tmpl;
 	struct list_head userpages;
+	struct list_head dmabufs;
 
 	struct packet_stats pstats;
 	struct driver_stats dstats;
@@ -219,9 +377,21 @@ struct stqueue_info {
 	struct list_head list;
 
 	unsigned int flags;
+	bool userspace;
 
-	struct eavb_entry ebuf[RAVB_ENTRY_THRETH];
+	enum eavb_entryformat entryformat;
+	/* holds fewer entries of the larger formats */
+	struct eavb_entry ebuf[RAVB_ENTRY_THRETH] __aligned(8);
 	bool cancel;
+	bool detaching; /* release in progress, launch times and gates ignored */
+
+	/* shared memory submission/completion ring */
+	struct eavb_ring *ring;
+	void *sq;
+	void *cq;
+	u32 sq_head;
+	u32 cq_tail;
+	struct list_head pendingCmds;
 };
 
 #define to_stq(x) container_of(x, struct stqueue_info, kobj)
@@ -248,7 +418,9 @@ struct hwqueue_info {
 
 	struct semaphore sem;
 
-	struct list_head activeStreamQueue;
+	/* one list per priority, activePrioMap marks the non-empty ones */
+	struct list_head activeStreamQueue[RAVB_STQUEUE_PRIO_NUM];
+	unsigned long activePrioMap;
 	struct list_head completeWaitQueue;
 
 	struct packet_stats pstats;
@@ -263,6 +435,33 @@ struct hwqueue_info {
 	wait_queue_head_t waitEvent;
 	struct task_struct *task;
 	struct hrtimer timer;
+	struct hrtimer launch_timer;
+	bool gated; /* entries held until their launch time */
+	/* per encode pass burst limits, 0 for no limit */
+	u32 burst_entries;
+	u32 burst_bytes;
+	u32 stq_burst_entries;
+	u32 stq_burst_bytes;
+	u32 pass; /* encode pass number */
+	bool yielded; /* pass ended on a burst limit with work left */
+	/* ring fill watermarks in descriptors and usec, 0 high for none */
+	u32 ring_high;
+	u32 ring_low;
+	u32 ring_high_usec;
+	u32 ring_low_usec;
+	u32 inflight_bytes; /* frame bytes of the descriptors in the ring */
+	bool draining; /* above the high watermark until down to the low */
+	u32 busy_poll_usec; /* spin budget instead of interrupts, 0 for none */
+	bool polling; /* waiting for completions by busy poll */
+	bool quiesced; /* no new entries to the hardware while reconfiguring */
+	u64 irq_stamp; /* first interrupt not followed by a wakeup yet */
+	u64 wakeup_latency[RAVB_LATENCY_BUCKETS];
+	cpumask_t cpus; /* of the task and the interrupt */
+	int rt_prio; /* SCHED_FIFO priority of the task, 0 for SCHED_NORMAL */
+	const struct ravb_sched_ops *sched;
+	struct gate_info gate;
+	int detaching; /* stream queues being released, their levels open */
+	struct coalesce_info coalesce;
 	int irq;
 	int irq_coalesce_frame_count;
 };
@@ -282,6 +481,8 @@ struct streaming_private {
 	struct semaphore sem;
 
 	struct list_head userpages;
+	struct rb_root regions;
+	spinlock_t region_lock;
 };
 
 #define to_stp(x) container_of(x, struct streaming_private, device)
@@ -291,5 +492,16 @@ extern struct streaming_private *stp_ptr;
 
 int register_streamID(struct hwqueue_info *hwq, u8 streamID[8]);
 const char *avb_state_to_str(enum AVB_STATE state);
+ssize_t avb_scheduler_show(struct hwqueue_info *hwq, char *page);
+int avb_scheduler_store(struct hwqueue_info *hwq, const char *name);
+int avb_set_ringsize(struct hwqueue_info *hwq, u32 size);
+int avb_set_ringparam(struct streaming_private *stp, u32 tx_size,
+		      u32 rx_size);
+int avb_set_cpus(struct hwqueue_info *hwq, const struct cpumask *cpus);
+int avb_set_rt_prio(struct hwqueue_info *hwq, int prio);
+void avb_get_coalesce(struct hwqueue_info *hwq,
+		      struct eavb_avbtool_coalesce *coalesce);
+int avb_set_coalesce(struct hwqueue_info *hwq,
+		     const struct eavb_avbtool_coalesce *coalesce);
 
 #endif	/* #ifndef __RAVB_STREAMING_H__ */
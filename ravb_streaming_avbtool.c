@@ -62,6 +62,7 @@
 #undef pr_fmt
 #define pr_fmt(fmt) KBUILD_MODNAME "/" fmt
 
+#include <linux/capability.h>
 #include <linux/interrupt.h>
 
 #include "../drivers/net/ethernet/renesas/ravb.h"
@@ -132,6 +133,8 @@ static void correct_dstats_stp(struct stqueue_info *stq,
 		dstats->tx_current += hwq->dstats.tx_current;
 		dstats->rx_dirty += hwq->dstats.rx_dirty;
 		dstats->tx_dirty += hwq->dstats.tx_dirty;
+		dstats->poll_hits += hwq->dstats.poll_hits;
+		dstats->poll_misses += hwq->dstats.poll_misses;
 
 		list_for_each_entry(stq_kobj, &hwq->attached->list, entry) {
 			stq = to_stq(stq_kobj);
@@ -139,6 +142,11 @@ static void correct_dstats_stp(struct stqueue_info *stq,
 			dstats->tx_entry_wait += stq->dstats.tx_entry_wait;
 			dstats->rx_entry_complete += stq->dstats.rx_entry_complete;
 			dstats->tx_entry_complete += stq->dstats.tx_entry_complete;
+			dstats->cachesync_ranges += stq->dstats.cachesync_ranges;
+			dstats->cachesync_calls += stq->dstats.cachesync_calls;
+			dstats->starved += stq->dstats.starved;
+			dstats->deadline_misses += stq->dstats.deadline_misses;
+			dstats->nonconforming += stq->dstats.nonconforming;
 		}
 	}
 }
@@ -158,10 +166,17 @@ static void correct_dstats(struct stqueue_info *stq,
 		dstats->tx_current = hwq->dstats.tx_current;
 		dstats->rx_dirty = hwq->dstats.rx_dirty;
 		dstats->tx_dirty = hwq->dstats.tx_dirty;
+		dstats->poll_hits = hwq->dstats.poll_hits;
+		dstats->poll_misses = hwq->dstats.poll_misses;
 		dstats->rx_entry_wait = stq->dstats.rx_entry_wait;
 		dstats->tx_entry_wait = stq->dstats.tx_entry_wait;
 		dstats->rx_entry_complete = stq->dstats.rx_entry_complete;
 		dstats->tx_entry_complete = stq->dstats.tx_entry_complete;
+		dstats->cachesync_ranges = stq->dstats.cachesync_ranges;
+		dstats->cachesync_calls = stq->dstats.cachesync_calls;
+		dstats->starved = stq->dstats.starved;
+		dstats->deadline_misses = stq->dstats.deadline_misses;
+		dstats->nonconforming = stq->dstats.nonconforming;
 	}
 }
 
@@ -187,6 +202,13 @@ static const char ravb_avbtool_gstrings_stats[][EAVB_GSTRING_LEN] = {
 	"tx_entry_wait",
 	"rx_entry_complete",
 	"tx_entry_complete",
+	"cachesync_ranges",
+	"cachesync_calls",
+	"starved",
+	"deadline_misses",
+	"nonconforming",
+	"poll_hits",
+	"poll_misses",
 };
 
 #define EAVB_AVBTOOL_STATS_LEN	ARRAY_SIZE(ravb_avbtool_gstrings_stats)
@@ -204,7 +226,7 @@ static long ravb_avbtool_get_drvinfo(struct file *file, unsigned long parm)
 
 	pr_debug("get_drvinfo:\n");
 
-	strlcpy(info.bus_info,
+	strscpy(info.bus_info,
 		dev_name(ndev->dev.parent),
 		sizeof(info.bus_info));
 
@@ -216,22 +238,98 @@ static long ravb_avbtool_get_drvinfo(struct file *file, unsigned long parm)
 
 static long ravb_avbtool_get_ringparam(struct file *file, unsigned long parm)
 {
+	struct streaming_private *stp = stp_ptr;
+	struct hwqueue_info *hwq;
 	void __user *useraddr = (void __user *)parm;
 	struct eavb_avbtool_ringparam ringparam = {
 		.rx_max_pending = RAVB_RINGSIZE,
-		.rx_pending = RAVB_RINGSIZE,
 		.tx_max_pending = RAVB_RINGSIZE,
-		.tx_pending = RAVB_RINGSIZE,
 	};
+	u32 size;
+	int i;
 
 	pr_debug("get_ringparam:\n");
 
+	/* the largest ring of each direction, sizes count the LINKFIX */
+	for (i = 0; i < RAVB_HWQUEUE_NUM; i++) {
+		hwq = &stp->hwqueueInfoTable[i];
+		size = hwq->ringsize + 1;
+		if (hwq->tx)
+			ringparam.tx_pending = max(ringparam.tx_pending, size);
+		else
+			ringparam.rx_pending = max(ringparam.rx_pending, size);
+	}
+
 	if (copy_to_user(useraddr, &ringparam, sizeof(ringparam)))
 		return -EFAULT;
 
 	return 0;
 }
 
+static long ravb_avbtool_set_ringparam(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	void __user *useraddr = (void __user *)parm;
+	struct eavb_avbtool_ringparam ringparam;
+
+	pr_debug("set_ringparam:\n");
+
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&ringparam, useraddr, sizeof(ringparam)))
+		return -EFAULT;
+
+	if (ringparam.rx_mini_pending || ringparam.rx_jumbo_pending)
+		return -EINVAL;
+
+	return avb_set_ringparam(stp, ringparam.tx_pending,
+				 ringparam.rx_pending);
+}
+
+static long ravb_avbtool_get_coalesce(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	void __user *useraddr = (void __user *)parm;
+	struct eavb_avbtool_coalesce coalesce;
+
+	pr_debug("get_coalesce:\n");
+
+	if (copy_from_user(&coalesce, useraddr, sizeof(coalesce)))
+		return -EFAULT;
+
+	if (coalesce.queue >= RAVB_HWQUEUE_NUM)
+		return -EINVAL;
+
+	avb_get_coalesce(&stp->hwqueueInfoTable[coalesce.queue], &coalesce);
+
+	if (copy_to_user(useraddr, &coalesce, sizeof(coalesce)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long ravb_avbtool_set_coalesce(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	void __user *useraddr = (void __user *)parm;
+	struct eavb_avbtool_coalesce coalesce;
+
+	pr_debug("set_coalesce:\n");
+
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&coalesce, useraddr, sizeof(coalesce)))
+		return -EFAULT;
+
+	if (coalesce.queue >= RAVB_HWQUEUE_NUM)
+		return -EINVAL;
+
+	return avb_set_coalesce(&stp->hwqueueInfoTable[coalesce.queue],
+				&coalesce);
+}
+
 static long ravb_avbtool_get_channels(struct file *file, unsigned long parm)
 {
 	void __user *useraddr = (void __user *)parm;
@@ -409,6 +507,13 @@ static long ravb_avbtool_get_stats(struct file *file, unsigned long parm)
 	data[i++] = dstats.tx_entry_wait;
 	data[i++] = dstats.rx_entry_complete;
 	data[i++] = dstats.tx_entry_complete;
+	data[i++] = dstats.cachesync_ranges;
+	data[i++] = dstats.cachesync_calls;
+	data[i++] = dstats.starved;
+	data[i++] = dstats.deadline_misses;
+	data[i++] = dstats.nonconforming;
+	data[i++] = dstats.poll_hits;
+	data[i++] = dstats.poll_misses;
 
 	err = -EFAULT;
 	if (copy_to_user(useraddr, &stats, sizeof(stats)))
@@ -434,8 +539,14 @@ long ravb_streaming_ioctl_avbtool(struct file *file,
 	switch (cmd) {
 	case EAVB_GDRVINFO:
 		return ravb_avbtool_get_drvinfo(file, parm);
+	case EAVB_GCOALESCE:
+		return ravb_avbtool_get_coalesce(file, parm);
+	case EAVB_SCOALESCE:
+		return ravb_avbtool_set_coalesce(file, parm);
 	case EAVB_GRINGPARAM:
 		return ravb_avbtool_get_ringparam(file, parm);
+	case EAVB_SRINGPARAM:
+		return ravb_avbtool_set_ringparam(file, parm);
 	case EAVB_GCHANNELS:
 		return ravb_avbtool_get_channels(file, parm);
 	case EAVB_GSSET_INFO:
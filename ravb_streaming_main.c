@@ -69,6 +69,7 @@
 #include <linux/spinlock.h>
 #include <linux/interrupt.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
 #include <linux/etherdevice.h>
 #include <linux/delay.h>
 #include <linux/platform_device.h>
@@ -84,7 +85,10 @@
 #include <linux/clk.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/rbtree.h>
 #include <linux/poll.h>
 #include <linux/vmalloc.h>
 #include <linux/kthread.h>
@@ -94,6 +98,11 @@
 #include <linux/of_device.h>
 #include <linux/sh_eth.h>
 #include <linux/hrtimer.h>
+#if KERNEL_VERSION(6, 7, 0) <= LINUX_VERSION_CODE
+#include <linux/io_uring/cmd.h>
+#elif KERNEL_VERSION(5, 19, 0) <= LINUX_VERSION_CODE
+#include <linux/io_uring.h>
+#endif
 
 #include "../drivers/net/ethernet/renesas/ravb.h"
 #include "ravb_streaming.h"
@@ -133,6 +142,14 @@ module_param(irq_coalesce_frame_tx, int, 0660);
 static int irq_coalesce_frame_rx;
 module_param(irq_coalesce_frame_rx, int, 0660);
 
+static int irq_coalesce_adaptive;
+module_param(irq_coalesce_adaptive, int, 0440);
+MODULE_PARM_DESC(irq_coalesce_adaptive, "Choose interrupt coalescing from the completion rate (1) or use the irq parameters (0)");
+
+static int irq_threaded;
+module_param(irq_threaded, int, 0440);
+MODULE_PARM_DESC(irq_threaded, "Process completions in a threaded IRQ handler (1) or in the hwqueue task (0), R-Car Gen3 only");
+
 static int avb_rt_prio;
 module_param(avb_rt_prio, int, 0440);
 MODULE_PARM_DESC(avb_rt_prio, "apply RT priority to worker thread (1-99) or do NOT apply RT priority (0)");
@@ -141,8 +158,11 @@ static int irq_tx_tail;
 module_param(irq_tx_tail, int, 0440);
 MODULE_PARM_DESC(irq_tx_tail, "Enable TX IRQ optimization");
 
+static int launch_lead_usec;
+module_param(launch_lead_usec, int, 0660);
+MODULE_PARM_DESC(launch_lead_usec, "release timed entries this early before their launch time");
+
 struct streaming_private *stp_ptr;
-static struct kmem_cache *streaming_entry_cache;
 
 /**
  * utilities
@@ -216,6 +236,33 @@ static inline bool uncached_access(struct stqueue_info *stq)
 	return !!(stq->flags & O_DSYNC);
 }
 
+static inline bool count_only(struct stqueue_info *stq)
+{
+	return stq->completion == EAVB_COMPLETION_COUNT;
+}
+
+/* Caller must hold hwq->sem */
+static void hwq_activate_stq(struct hwqueue_info *hwq,
+			     struct stqueue_info *stq)
+{
+	list_add_tail(&stq->list, &hwq->activeStreamQueue[stq->priority]);
+	__set_bit(stq->priority, &hwq->activePrioMap);
+}
+
+/* Caller must hold hwq->sem */
+static void hwq_deactivate_stq(struct hwqueue_info *hwq,
+			       struct stqueue_info *stq)
+{
+	list_del(&stq->list);
+	if (list_empty(&hwq->activeStreamQueue[stq->priority]))
+		__clear_bit(stq->priority, &hwq->activePrioMap);
+}
+
+static inline bool hwq_is_active(struct hwqueue_info *hwq)
+{
+	return !!hwq->activePrioMap;
+}
+
 static inline bool is_readable_count(struct stqueue_info *stq,
 				     unsigned int count)
 {
@@ -283,6 +330,8 @@ static inline u32 hwq_event_irq(struct hwqueue_info *hwq,
 	case AVB_EVENT_TXINT:
 	case AVB_EVENT_UNLOAD:
 	case AVB_EVENT_TIMEOUT:
+	case AVB_EVENT_LAUNCH:
+	case AVB_EVENT_GATE:
 		if (!(events & event)) {
 			hwq->pendingEvents |= event;
 			avb_wake_up_interruptible(&hwq->waitEvent,
@@ -324,16 +373,7 @@ static inline u32 hwq_event_clear(struct hwqueue_info *hwq)
 
 static void hwq_try_to_start_irq_timeout_timer(struct hwqueue_info *hwq)
 {
-	int irq_timeout_usec;
-
-	if (hwq->tx) {
-		if (!hwq->index)
-			irq_timeout_usec = irq_timeout_usec_tx0;
-		else
-			irq_timeout_usec = irq_timeout_usec_tx1;
-	} else {
-		irq_timeout_usec = irq_timeout_usec_rx;
-	}
+	int irq_timeout_usec = READ_ONCE(hwq->coalesce.usec);
 
 	if (irq_timeout_usec)
 		hrtimer_start(&hwq->timer,
@@ -341,18 +381,152 @@ static void hwq_try_to_start_irq_timeout_timer(struct hwqueue_info *hwq)
 			      HRTIMER_MODE_REL);
 }
 
+/**
+ * adaptive interrupt coalescing
+ *
+ * Every sample period the completion rate of the hwqueue moves it at
+ * most one level along the profile table, stepping down only once the
+ * rate falls to half the threshold of its level. Sparse audio streams
+ * stay at level 0 with an interrupt per frame, heavy video streams
+ * climb to fewer interrupts per frame bounded by the timeout. Without
+ * adaptive coalescing the last values set through avbtool or the irq
+ * module parameters apply, a parameter write picked up at the next
+ * sample.
+ */
+static const struct {
+	u32 frame_rate; /* entered at or above this rate */
+	int frames;
+	int usec;
+} ravb_coalesce_profiles[] = {
+	{      0,  0,   0 },
+	{   8000,  2,  50 },
+	{  16000,  4, 100 },
+	{  32000,  8, 200 },
+	{  64000, 16, 400 },
+};
+
+/* Frames per interrupt beyond the ring would never raise one */
+static int hwq_coalesce_frames_max(struct hwqueue_info *hwq)
+{
+	return hwq->ringsize - 1;
+}
+
+static void hwq_coalesce_params(struct hwqueue_info *hwq,
+				int *frames, int *usec)
+{
+	if (hwq->tx) {
+		*frames = READ_ONCE(irq_coalesce_frame_tx);
+		*usec = hwq->index ? READ_ONCE(irq_timeout_usec_tx1) :
+			READ_ONCE(irq_timeout_usec_tx0);
+	} else {
+		*frames = READ_ONCE(irq_coalesce_frame_rx);
+		*usec = READ_ONCE(irq_timeout_usec_rx);
+	}
+}
+
+static void hwq_coalesce_init(struct hwqueue_info *hwq)
+{
+	struct coalesce_info *c = &hwq->coalesce;
+
+	memset(c, 0, sizeof(*c));
+	c->adaptive = !!irq_coalesce_adaptive;
+	hwq_coalesce_params(hwq, &c->param_frames, &c->param_usec);
+	if (!c->adaptive) {
+		c->frames = min(c->param_frames, hwq_coalesce_frames_max(hwq));
+		c->usec = c->param_usec;
+	}
+	hwq->irq_coalesce_frame_count = c->frames;
+}
+
+static u64 hwq_interrupts(struct hwqueue_info *hwq)
+{
+	return hwq->tx ? hwq->dstats.tx_interrupts : hwq->dstats.rx_interrupts;
+}
+
+static void hwq_coalesce_sample(struct hwqueue_info *hwq)
+{
+	struct coalesce_info *c = &hwq->coalesce;
+	u64 now, elapsed, interrupts;
+	int level, frames, usec;
+
+	now = ktime_get_ns();
+	elapsed = now - c->sample_start;
+	if (elapsed < RAVB_COALESCE_SAMPLE_NSEC)
+		return;
+
+	interrupts = hwq_interrupts(hwq);
+	c->frame_rate = div64_u64((u64)c->completed * NSEC_PER_SEC, elapsed);
+	c->irq_rate = div64_u64((interrupts - c->interrupts) * NSEC_PER_SEC,
+				elapsed);
+	c->sample_start = now;
+	c->interrupts = interrupts;
+	c->completed = 0;
+
+	if (READ_ONCE(c->adaptive)) {
+		level = c->level;
+		if (level < ARRAY_SIZE(ravb_coalesce_profiles) - 1 &&
+		    c->frame_rate >= ravb_coalesce_profiles[level + 1].frame_rate)
+			level++;
+		else if (level &&
+			 c->frame_rate < ravb_coalesce_profiles[level].frame_rate / 2)
+			level--;
+		c->level = level;
+		frames = ravb_coalesce_profiles[level].frames;
+		usec = ravb_coalesce_profiles[level].usec;
+	} else {
+		/* values set through avbtool stay until a parameter write */
+		hwq_coalesce_params(hwq, &frames, &usec);
+		if (frames == c->param_frames && usec == c->param_usec)
+			return;
+		c->param_frames = frames;
+		c->param_usec = usec;
+		frames = min(frames, hwq_coalesce_frames_max(hwq));
+	}
+
+	/* do not carry a longer countdown into a lower level */
+	if (hwq->irq_coalesce_frame_count > frames)
+		hwq->irq_coalesce_frame_count = frames;
+	c->frames = frames;
+	WRITE_ONCE(c->usec, usec);
+}
+
 /**
  * streaming entry operations
+ *
+ * Each stream queue owns RAVB_ENTRY_THRETH entries allocated at open,
+ * which bounds its entries in flight and keeps the slab allocator out
+ * of the data path.
  */
-static struct stream_entry *get_streaming_entry(void)
+static int stq_entry_pool_init(struct stqueue_info *stq)
+{
+	struct stream_entry *e;
+	int i;
+
+	stq->entryPool = vzalloc(RAVB_ENTRY_THRETH * sizeof(*e));
+	if (!stq->entryPool)
+		return -ENOMEM;
+
+	for (i = 0, e = stq->entryPool; i < RAVB_ENTRY_THRETH; i++, e++) {
+		e->stq = stq;
+		list_add_tail(&e->list, &stq->entryFreeQueue);
+	}
+
+	return 0;
+}
+
+static struct stream_entry *get_streaming_entry(struct stqueue_info *stq)
 {
 	struct stream_entry *e;
 
-	e = kmem_cache_alloc(streaming_entry_cache, GFP_KERNEL);
+	spin_lock(&stq->entryLock);
+	e = list_first_entry_or_null(&stq->entryFreeQueue,
+				     struct stream_entry, list);
+	if (e)
+		list_del_init(&e->list);
+	spin_unlock(&stq->entryLock);
 	if (!e)
 		return NULL;
 
-	INIT_LIST_HEAD(&e->list);
 	memset(e->descs, 0, sizeof(e->descs));
 	e->total_bytes = 0;
 	e->errors = 0;
@@ -364,35 +538,253 @@ static struct stream_entry *get_streaming_entry(void)
 
 static void put_streaming_entry(struct stream_entry *e)
 {
+	struct stqueue_info *stq = e->stq;
+
 	trace_avb_entry_put(e);
 
-	list_del(&e->list);
-	kmem_cache_free(streaming_entry_cache, e);
+	spin_lock(&stq->entryLock);
+	list_move(&e->list, &stq->entryFreeQueue);
+	spin_unlock(&stq->entryLock);
 }
 
-static void cachesync_streaming_entry(struct stream_entry *e)
+/**
+ * dma region index
+ *
+ * Userpages, pools and attached dma-bufs never overlap, so they are kept
+ * in one rbtree sorted by DMA address and any address inside a region
+ * can be resolved in O(log n).
+ */
+/* Caller must hold stp->region_lock */
+static struct ravb_dma_region *lookup_region(dma_addr_t addr)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct rb_node *node = stp->regions.rb_node;
+	struct ravb_dma_region *region;
+
+	while (node) {
+		region = rb_entry(node, struct ravb_dma_region, node);
+		if (addr < region->dma)
+			node = node->rb_left;
+		else if (addr - region->dma >= region->size)
+			node = node->rb_right;
+		else
+			return region;
+	}
+
+	return NULL;
+}
+
+/* Bounds of the region holding addr, false if there is none */
+static bool lookup_region_bounds(dma_addr_t addr,
+				 dma_addr_t *start, dma_addr_t *end)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_dma_region *region;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stp->region_lock, flags);
+	region = lookup_region(addr);
+	if (region) {
+		*start = region->dma;
+		*end = region->dma + region->size;
+	}
+	spin_unlock_irqrestore(&stp->region_lock, flags);
+
+	return region != NULL;
+}
+
+static int insert_region(struct ravb_dma_region *new)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct rb_node **link = &stp->regions.rb_node;
+	struct rb_node *parent = NULL;
+	struct ravb_dma_region *region;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stp->region_lock, flags);
+	while (*link) {
+		parent = *link;
+		region = rb_entry(parent, struct ravb_dma_region, node);
+		if (new->dma + new->size <= region->dma) {
+			link = &parent->rb_left;
+		} else if (new->dma >= region->dma + region->size) {
+			link = &parent->rb_right;
+		} else {
+			spin_unlock_irqrestore(&stp->region_lock, flags);
+			return -EEXIST;
+		}
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &stp->regions);
+	spin_unlock_irqrestore(&stp->region_lock, flags);
+
+	return 0;
+}
+
+static void erase_region(struct ravb_dma_region *region)
+{
+	struct streaming_private *stp = stp_ptr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stp->region_lock, flags);
+	if (!RB_EMPTY_NODE(&region->node)) {
+		rb_erase(&region->node, &stp->regions);
+		RB_CLEAR_NODE(&region->node);
+	}
+	spin_unlock_irqrestore(&stp->region_lock, flags);
+}
+
+/* Caller must hold stp->region_lock */
+static inline bool region_accessible(struct ravb_dma_region *region,
+				     struct stqueue_info *stq)
+{
+	return !region->owner || region->owner == stq;
+}
+
+/* Caller must hold stp->region_lock */
+static bool validate_entryvec(struct stqueue_info *stq,
+			      struct eavb_entryvec *evec)
+{
+	struct ravb_dma_region *region;
+
+	region = lookup_region(evec->base);
+	if (!region || !region_accessible(region, stq))
+		return false;
+
+	return evec->len <= region->size - (evec->base - region->dma);
+}
+
+/**
+ * batched cache maintenance
+ *
+ * The vectors of a whole read/write batch are collected into a few open
+ * ranges. A vector adjacent to or overlapping an open range of the same
+ * DMA region extends that range instead of costing its own sync call.
+ * Ranges are only merged inside one region, since neighbouring mappings
+ * need not be physically contiguous behind an IOMMU. Regions are told
+ * apart by their bounds, copied under stp->region_lock, so a region
+ * unregistered meanwhile is never dereferenced.
+ */
+#define RAVB_CACHESYNC_SLOTS (4)
+
+struct ravb_cachesync_range {
+	dma_addr_t start;
+	dma_addr_t end;
+	dma_addr_t region_start; /* both 0 outside any region */
+	dma_addr_t region_end;
+};
+
+struct ravb_cachesync {
+	struct device *dev;
+	bool tx;
+	int used;
+	int victim;
+	struct ravb_cachesync_range range[RAVB_CACHESYNC_SLOTS];
+	u64 ranges;	/* vectors requested */
+	u64 calls;	/* dma_sync calls issued */
+};
+
+static void cachesync_init(struct ravb_cachesync *sync, bool tx)
 {
-	struct eavb_entryvec *evec;
-	int i;
 	struct streaming_private *stp = stp_ptr;
 	struct net_device *ndev = to_net_dev(stp->device.parent);
-	struct device *pdev_dev = ndev->dev.parent;
 
-	evec = e->msg.vec;
+	sync->dev = ndev->dev.parent;
+	sync->tx = tx;
+	sync->used = 0;
+	sync->victim = 0;
+	sync->ranges = 0;
+	sync->calls = 0;
+}
 
-	if (e->stq->hwq->tx) {
-		for (i = 0; i < e->vecsize; i++, evec++)
-			dma_sync_single_for_device(pdev_dev,
-						   evec->base,
-						   evec->len,
-						   DMA_TO_DEVICE);
+static void cachesync_issue(struct ravb_cachesync *sync,
+			    struct ravb_cachesync_range *range)
+{
+	if (sync->tx)
+		dma_sync_single_for_device(sync->dev,
+					   range->start,
+					   range->end - range->start,
+					   DMA_TO_DEVICE);
+	else
+		dma_sync_single_for_cpu(sync->dev,
+					range->start,
+					range->end - range->start,
+					DMA_FROM_DEVICE);
+	sync->calls++;
+}
+
+static void cachesync_add(struct ravb_cachesync *sync,
+			  dma_addr_t start, u32 len)
+{
+	struct ravb_cachesync_range *range;
+	dma_addr_t region_start = 0, region_end = 0;
+	dma_addr_t end = start + len;
+	int i;
+
+	/* base 0 carries no buffer */
+	if (!start || !len)
+		return;
+
+	sync->ranges++;
+
+	/* already covered by an open range */
+	for (i = 0, range = sync->range; i < sync->used; i++, range++)
+		if (start >= range->start && end <= range->end)
+			return;
+
+	if (lookup_region_bounds(start, &region_start, &region_end)) {
+		for (i = 0, range = sync->range; i < sync->used; i++, range++) {
+			if (range->region_start != region_start ||
+			    range->region_end != region_end ||
+			    start > range->end || end < range->start)
+				continue;
+			range->start = min(range->start, start);
+			range->end = max(range->end, end);
+			return;
+		}
+	}
+
+	if (sync->used < RAVB_CACHESYNC_SLOTS) {
+		range = &sync->range[sync->used++];
 	} else {
-		for (i = 0; i < e->vecsize; i++, evec++)
-			dma_sync_single_for_cpu(pdev_dev,
-						evec->base,
-						evec->len,
-						DMA_FROM_DEVICE);
+		range = &sync->range[sync->victim];
+		sync->victim = (sync->victim + 1) % RAVB_CACHESYNC_SLOTS;
+		cachesync_issue(sync, range);
 	}
+
+	range->start = start;
+	range->end = end;
+	range->region_start = region_start;
+	range->region_end = region_end;
+}
+
+static void cachesync_add_entry(struct ravb_cachesync *sync,
+				struct stream_entry *e)
+{
+	struct eavb_entryvec *evec = e->msg.vec;
+	int i;
+
+	for (i = 0; i < e->vecsize; i++, evec++)
+		cachesync_add(sync, evec->base, evec->len);
+}
+
+static void cachesync_flush(struct ravb_cachesync *sync)
+{
+	int i;
+
+	for (i = 0; i < sync->used; i++)
+		cachesync_issue(sync, &sync->range[i]);
+
+	sync->used = 0;
+	sync->victim = 0;
+}
+
+/* Caller must hold hwq->sem */
+static void cachesync_account(struct stqueue_info *stq,
+			      struct ravb_cachesync *sync)
+{
+	stq->dstats.cachesync_ranges += sync->ranges;
+	stq->dstats.cachesync_calls += sync->calls;
 }
 
 /**
@@ -418,8 +810,11 @@ static struct ravb_user_page *get_userpage(void)
 		goto err_map;
 
 	INIT_LIST_HEAD(&userpage->list);
+	RB_CLEAR_NODE(&userpage->region.node);
 	userpage->page = page;
-	userpage->page_dma = page_dma;
+	userpage->region.dma = page_dma;
+	userpage->region.size = PAGE_SIZE;
+	kref_init(&userpage->ref);
 
 	return userpage;
 
@@ -431,112 +826,487 @@ err_alloc:
 	return NULL;
 }
 
-static void put_userpage(struct ravb_user_page *userpage)
+static struct ravb_user_page *get_userpool(size_t size)
 {
+	struct page *page;
+	dma_addr_t page_dma;
+	struct ravb_user_page *userpage;
 	struct streaming_private *stp = stp_ptr;
 	struct net_device *ndev = to_net_dev(stp->device.parent);
 	struct device *pdev_dev = ndev->dev.parent;
 
-	dma_unmap_page(pdev_dev,
-		       userpage->page_dma,
-		       PAGE_SIZE,
-		       DMA_FROM_DEVICE);
-	put_page(userpage->page);
-	list_del(&userpage->list);
+	userpage = vzalloc(sizeof(*userpage));
+	if (unlikely(!userpage))
+		goto err_alloc;
+	userpage->chunk_map = bitmap_zalloc(size / RAVB_USERPOOL_CHUNK,
+					    GFP_KERNEL);
+	if (unlikely(!userpage->chunk_map))
+		goto err_allocmap;
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+	/* physically contiguous, from CMA if the device has one */
+	page = dma_alloc_pages(pdev_dev, size, &page_dma, DMA_BIDIRECTIONAL,
+			       GFP_KERNEL | __GFP_NOWARN);
+#else
+	page = NULL;
+#endif
+	if (unlikely(!page))
+		goto err_allocpage;
+
+	INIT_LIST_HEAD(&userpage->list);
+	RB_CLEAR_NODE(&userpage->region.node);
+	userpage->page = page;
+	userpage->region.dma = page_dma;
+	userpage->region.size = size;
+	kref_init(&userpage->ref);
+
+	return userpage;
+
+err_allocpage:
+	bitmap_free(userpage->chunk_map);
+err_allocmap:
 	vfree(userpage);
+err_alloc:
+	return NULL;
 }
 
-static struct ravb_user_page *lookup_userpage(struct stqueue_info *stq,
-					      dma_addr_t physaddr)
+static void userpage_release(struct kref *ref)
 {
+	struct ravb_user_page *userpage =
+		container_of(ref, struct ravb_user_page, ref);
 	struct streaming_private *stp = stp_ptr;
-	struct ravb_user_page *userpage;
+	struct net_device *ndev = to_net_dev(stp->device.parent);
+	struct device *pdev_dev = ndev->dev.parent;
 
-	if (list_empty(&stp->userpages) &&
-	    (stq && list_empty(&stq->userpages)))
-		return NULL;
+	if (userpage->chunk_map) {
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+		dma_free_pages(pdev_dev,
+			       userpage->region.size,
+			       userpage->page,
+			       userpage->region.dma,
+			       DMA_BIDIRECTIONAL);
+#endif
+		bitmap_free(userpage->chunk_map);
+	} else {
+		dma_unmap_page(pdev_dev,
+			       userpage->region.dma,
+			       PAGE_SIZE,
+			       DMA_FROM_DEVICE);
+		put_page(userpage->page);
+	}
+	vfree(userpage);
+}
 
-	if (stq)
-		/* search a userpage from stq userpages */
-		list_for_each_entry(userpage, &stq->userpages, list)
-			if (physaddr == userpage->page_dma)
-				break;
+/* Caller must hold stp->sem */
+static int add_userpage(struct stqueue_info *stq,
+			struct ravb_user_page *userpage)
+{
+	struct streaming_private *stp = stp_ptr;
+	int err;
 
-	/* not found a userpage in stq userpages */
-	if (!stq || &userpage->list == &stq->userpages) {
-		/* search a userpage from stp userpages */
-		list_for_each_entry(userpage, &stp->userpages, list)
-			if (physaddr == userpage->page_dma)
-				break;
+	userpage->region.owner = stq;
+	err = insert_region(&userpage->region);
+	if (err)
+		return err;
 
-		if (&userpage->list == &stp->userpages)
-			return NULL;
-	}
+	if (stq)
+		list_add_tail(&userpage->list, &stq->userpages);
+	else
+		list_add_tail(&userpage->list, &stp->userpages);
 
-	return userpage;
+	return 0;
 }
 
-/**
- * descriptor encode/decode
- */
-static void clear_desc(struct hwqueue_info *hwq)
+static void put_userpage(struct ravb_user_page *userpage)
 {
-	struct ravb_desc *desc;
-	int j;
+	erase_region(&userpage->region);
+	list_del(&userpage->list);
+	kref_put(&userpage->ref, userpage_release);
+}
 
-	/* init all descriptor type */
-	for (j = 0, desc = hwq->ring; j < hwq->ringsize; j++, desc++)
-		desc->die_dt = (hwq->tx) ? DT_FEMPTY : DT_FSINGLE;
-	/* link tail desc to head desc */
-	desc->die_dt = DT_LINKFIX;
-	desc->dptr = cpu_to_le32((u32)hwq->ring_dma);
+/* Caller must hold stp->sem */
+static int userpool_alloc(struct ravb_user_page *userpage, size_t size,
+			  dma_addr_t *chunk_dma)
+{
+	unsigned long nr = userpage->region.size / RAVB_USERPOOL_CHUNK;
+	unsigned long count = DIV_ROUND_UP(size, RAVB_USERPOOL_CHUNK);
+	unsigned long start;
 
-	hwq->remain = hwq->ringsize;
-	hwq->curr = 0;
+	start = bitmap_find_next_zero_area(userpage->chunk_map, nr, 0,
+					   count, 0);
+	if (start >= nr)
+		return -ENOMEM;
 
-	hwq->dstats.rx_dirty = hwq->dstats.rx_current;
-	hwq->dstats.tx_dirty = hwq->dstats.tx_current;
+	bitmap_set(userpage->chunk_map, start, count);
+	*chunk_dma = userpage->region.dma + start * RAVB_USERPOOL_CHUNK;
+
+	return 0;
 }
 
-static void *get_desc(struct hwqueue_info *hwq, dma_addr_t *desc_dma)
+/* Caller must hold stp->sem */
+static int userpool_free(struct ravb_user_page *userpage,
+			 dma_addr_t chunk_dma, size_t size)
 {
-	struct ravb_desc *desc;
+	unsigned long nr = userpage->region.size / RAVB_USERPOOL_CHUNK;
+	unsigned long count = DIV_ROUND_UP(size, RAVB_USERPOOL_CHUNK);
+	unsigned long start;
 
-	desc = hwq->ring + hwq->curr;
-	*desc_dma = hwq->ring_dma + (dma_addr_t)(sizeof(*desc) * hwq->curr);
+	if (chunk_dma < userpage->region.dma ||
+	    (chunk_dma - userpage->region.dma) % RAVB_USERPOOL_CHUNK)
+		return -EINVAL;
 
-	hwq->remain--;
-	hwq->curr = (hwq->curr + 1) % hwq->ringsize;
-	/* Keep lowest free descriptor use - since driver load */
-	hwq->minremain = min_t(s32, hwq->minremain, hwq->remain);
+	start = (chunk_dma - userpage->region.dma) / RAVB_USERPOOL_CHUNK;
+	if (!count || start + count > nr)
+		return -EINVAL;
 
-	return desc;
-}
+	/* whole range must be allocated */
+	if (find_next_zero_bit(userpage->chunk_map, start + count, start) <
+	    start + count)
+		return -EINVAL;
 
-static void put_desc(struct hwqueue_info *hwq, void *buf)
-{
-	struct ravb_desc *desc = buf;
+	bitmap_clear(userpage->chunk_map, start, count);
 
-	if (desc)
-		hwq->remain++;
+	return 0;
 }
 
-static int desc_pre_encode_rx(struct stream_entry *e)
+static struct ravb_user_page *lookup_userpage(struct stqueue_info *stq,
+					      dma_addr_t physaddr)
 {
-	struct ravb_rx_desc *desc;
-	struct eavb_entryvec *evec;
-	int i;
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_dma_region *region;
+	unsigned long flags;
 
-	evec = e->msg.vec;
+	spin_lock_irqsave(&stp->region_lock, flags);
+	region = lookup_region(physaddr);
+	if (region &&
+	    (region->dmabuf || region->dma != physaddr ||
+	     !region_accessible(region, stq)))
+		region = NULL;
+	spin_unlock_irqrestore(&stp->region_lock, flags);
 
-	for (i = 0; i < EAVB_ENTRYVECNUM; i++, evec++) {
-		if (!evec->len)
-			break;
+	if (!region)
+		return NULL;
 
-		desc = (struct ravb_rx_desc *)&e->pre_enc[i];
-		desc->ds_cc = cpu_to_le16(evec->len);
-		desc->msc = 0;
-		desc->dptr = cpu_to_le32(evec->base);
+	return container_of(region, struct ravb_user_page, region);
+}
+
+/**
+ * dma-buf operations
+ */
+static struct sg_table *userpage_dmabuf_map(struct dma_buf_attachment *attach,
+					    enum dma_data_direction dir)
+{
+	struct ravb_user_page *userpage = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int err;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	err = sg_alloc_table(sgt, 1, GFP_KERNEL);
+	if (err)
+		goto err_alloc;
+
+	sg_set_page(sgt->sgl, userpage->page, userpage->region.size, 0);
+
+	err = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (err)
+		goto err_map;
+
+	return sgt;
+
+err_map:
+	sg_free_table(sgt);
+err_alloc:
+	kfree(sgt);
+
+	return ERR_PTR(err);
+}
+
+static void userpage_dmabuf_unmap(struct dma_buf_attachment *attach,
+				  struct sg_table *sgt,
+				  enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int userpage_dmabuf_mmap(struct dma_buf *dmabuf,
+				struct vm_area_struct *vma)
+{
+	struct ravb_user_page *userpage = dmabuf->priv;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if ((vma->vm_pgoff << PAGE_SHIFT) + size > userpage->region.size)
+		return -EINVAL;
+
+	return remap_pfn_range(vma,
+			       vma->vm_start,
+			       page_to_pfn(userpage->page) + vma->vm_pgoff,
+			       size,
+			       vma->vm_page_prot);
+}
+
+static void userpage_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct ravb_user_page *userpage = dmabuf->priv;
+
+	kref_put(&userpage->ref, userpage_release);
+}
+
+static const struct dma_buf_ops userpage_dmabuf_ops = {
+	.map_dma_buf = userpage_dmabuf_map,
+	.unmap_dma_buf = userpage_dmabuf_unmap,
+	.mmap = userpage_dmabuf_mmap,
+	.release = userpage_dmabuf_release,
+};
+
+static struct ravb_user_dmabuf *get_user_dmabuf(int fd)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct net_device *ndev = to_net_dev(stp->device.parent);
+	struct device *pdev_dev = ndev->dev.parent;
+	struct ravb_user_dmabuf *udmabuf;
+	struct scatterlist *sg;
+	long err;
+	int i;
+
+	udmabuf = kzalloc(sizeof(*udmabuf), GFP_KERNEL);
+	if (!udmabuf)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&udmabuf->list);
+	RB_CLEAR_NODE(&udmabuf->region.node);
+	udmabuf->region.dmabuf = true;
+
+	udmabuf->dmabuf = dma_buf_get(fd);
+	if (IS_ERR(udmabuf->dmabuf)) {
+		err = PTR_ERR(udmabuf->dmabuf);
+		goto err_get;
+	}
+
+	udmabuf->attach = dma_buf_attach(udmabuf->dmabuf, pdev_dev);
+	if (IS_ERR(udmabuf->attach)) {
+		err = PTR_ERR(udmabuf->attach);
+		goto err_attach;
+	}
+
+#if KERNEL_VERSION(6, 2, 0) <= LINUX_VERSION_CODE
+	udmabuf->sgt = dma_buf_map_attachment_unlocked(udmabuf->attach,
+						       DMA_BIDIRECTIONAL);
+#else
+	udmabuf->sgt = dma_buf_map_attachment(udmabuf->attach,
+					      DMA_BIDIRECTIONAL);
+#endif
+	if (IS_ERR(udmabuf->sgt)) {
+		err = PTR_ERR(udmabuf->sgt);
+		goto err_map;
+	}
+
+	/* descriptors take a single 32bit address per vector */
+	err = -EINVAL;
+	udmabuf->region.dma = sg_dma_address(udmabuf->sgt->sgl);
+	for_each_sgtable_dma_sg(udmabuf->sgt, sg, i) {
+		if (sg_dma_address(sg) !=
+		    udmabuf->region.dma + udmabuf->region.size)
+			goto err_layout;
+		udmabuf->region.size += sg_dma_len(sg);
+	}
+	if ((u64)udmabuf->region.dma + udmabuf->region.size > 0x100000000UL)
+		goto err_layout;
+
+	return udmabuf;
+
+err_layout:
+#if KERNEL_VERSION(6, 2, 0) <= LINUX_VERSION_CODE
+	dma_buf_unmap_attachment_unlocked(udmabuf->attach, udmabuf->sgt,
+					  DMA_BIDIRECTIONAL);
+#else
+	dma_buf_unmap_attachment(udmabuf->attach, udmabuf->sgt,
+				 DMA_BIDIRECTIONAL);
+#endif
+err_map:
+	dma_buf_detach(udmabuf->dmabuf, udmabuf->attach);
+err_attach:
+	dma_buf_put(udmabuf->dmabuf);
+err_get:
+	kfree(udmabuf);
+
+	return ERR_PTR(err);
+}
+
+static void put_user_dmabuf(struct ravb_user_dmabuf *udmabuf)
+{
+	erase_region(&udmabuf->region);
+#if KERNEL_VERSION(6, 2, 0) <= LINUX_VERSION_CODE
+	dma_buf_unmap_attachment_unlocked(udmabuf->attach, udmabuf->sgt,
+					  DMA_BIDIRECTIONAL);
+#else
+	dma_buf_unmap_attachment(udmabuf->attach, udmabuf->sgt,
+				 DMA_BIDIRECTIONAL);
+#endif
+	dma_buf_detach(udmabuf->dmabuf, udmabuf->attach);
+	dma_buf_put(udmabuf->dmabuf);
+	list_del(&udmabuf->list);
+	kfree(udmabuf);
+}
+
+/**
+ * in-flight buffers
+ *
+ * DMA memory must stay mapped while an entry points into it, from the
+ * time a writer validates the entry until it is read back complete.
+ * Entries still being prepared by a writer may point anywhere.
+ */
+static bool entry_references(struct stream_entry *e,
+			     dma_addr_t start, dma_addr_t end)
+{
+	struct eavb_entryvec *evec = e->msg.vec;
+	int i;
+
+	for (i = 0; i < e->vecsize; i++, evec++) {
+		if (evec->base && evec->len &&
+		    evec->base < end && evec->base + evec->len > start)
+			return true;
+	}
+
+	return false;
+}
+
+/* Caller must hold hwq->sem */
+static bool stq_references(struct stqueue_info *stq,
+			   dma_addr_t start, dma_addr_t end)
+{
+	struct stream_entry *e;
+
+	if (stq->preparing)
+		return true;
+
+	list_for_each_entry(e, &stq->entryWaitQueue, list)
+		if (entry_references(e, start, end))
+			return true;
+	list_for_each_entry(e, &stq->hwq->completeWaitQueue, list)
+		if (e->stq == stq && entry_references(e, start, end))
+			return true;
+	list_for_each_entry(e, &stq->entryLogQueue, list)
+		if (entry_references(e, start, end))
+			return true;
+
+	return false;
+}
+
+/* A NULL owner checks every open stream queue */
+static bool range_in_flight(struct stqueue_info *owner,
+			    dma_addr_t start, dma_addr_t end)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct hwqueue_info *hwq;
+	struct stqueue_info *stq;
+	bool busy = false;
+	int i, qno;
+
+	for (i = 0; i < RAVB_HWQUEUE_NUM && !busy; i++) {
+		hwq = &stp->hwqueueInfoTable[i];
+		if (owner && owner->hwq != hwq)
+			continue;
+
+		avb_down(&hwq->sem, hwq->index, -1);
+		for_each_set_bit(qno, hwq->stream_map, RAVB_STQUEUE_NUM) {
+			stq = hwq->stqueueInfoTable[qno];
+			if (owner && owner != stq)
+				continue;
+			if (stq_references(stq, start, end)) {
+				busy = true;
+				break;
+			}
+		}
+		avb_up(&hwq->sem, hwq->index, -1);
+	}
+
+	return busy;
+}
+
+/*
+ * Takes a region out of the index before it is freed, so that no new
+ * entry validates against it. A region still in flight is put back.
+ * Caller must hold stp->sem
+ */
+static int retire_region(struct ravb_dma_region *region)
+{
+	erase_region(region);
+	if (!range_in_flight(region->owner, region->dma,
+			     region->dma + region->size))
+		return 0;
+
+	WARN_ON(insert_region(region));
+
+	return -EBUSY;
+}
+
+/**
+ * descriptor encode/decode
+ */
+static void clear_desc(struct hwqueue_info *hwq)
+{
+	struct ravb_desc *desc;
+	int j;
+
+	/* init all descriptor type */
+	for (j = 0, desc = hwq->ring; j < hwq->ringsize; j++, desc++)
+		desc->die_dt = (hwq->tx) ? DT_FEMPTY : DT_FSINGLE;
+	/* link tail desc to head desc */
+	desc->die_dt = DT_LINKFIX;
+	desc->dptr = cpu_to_le32((u32)hwq->ring_dma);
+
+	hwq->remain = hwq->ringsize;
+	hwq->curr = 0;
+	hwq->inflight_bytes = 0;
+	hwq->draining = false;
+
+	hwq->dstats.rx_dirty = hwq->dstats.rx_current;
+	hwq->dstats.tx_dirty = hwq->dstats.tx_current;
+}
+
+static void *get_desc(struct hwqueue_info *hwq, dma_addr_t *desc_dma)
+{
+	struct ravb_desc *desc;
+
+	desc = hwq->ring + hwq->curr;
+	*desc_dma = hwq->ring_dma + (dma_addr_t)(sizeof(*desc) * hwq->curr);
+
+	hwq->remain--;
+	hwq->curr = (hwq->curr + 1) % hwq->ringsize;
+	/* Keep lowest free descriptor use - since driver load */
+	hwq->minremain = min_t(s32, hwq->minremain, hwq->remain);
+
+	return desc;
+}
+
+static void put_desc(struct hwqueue_info *hwq, void *buf)
+{
+	struct ravb_desc *desc = buf;
+
+	if (desc)
+		hwq->remain++;
+}
+
+static int desc_pre_encode_rx(struct stream_entry *e)
+{
+	struct ravb_rx_desc *desc;
+	struct eavb_entryvec *evec;
+	int i;
+
+	evec = e->msg.vec;
+
+	for (i = 0; i < e->msg.vecnum; i++, evec++) {
+		if (!evec->len)
+			break;
+
+		desc = (struct ravb_rx_desc *)&e->pre_enc[i];
+		desc->ds_cc = cpu_to_le16(evec->len);
+		desc->msc = 0;
+		desc->dptr = cpu_to_le32(evec->base);
 
 		/* DT change timing should be latest */
 		if (!evec->base)
@@ -556,7 +1326,7 @@ static int desc_pre_encode_tx(struct stream_entry *e)
 
 	evec = e->msg.vec;
 
-	for (i = 0; i < EAVB_ENTRYVECNUM; i++, evec++) {
+	for (i = 0; i < e->msg.vecnum; i++, evec++) {
 		if (!evec->base && !evec->len)
 			break;
 
@@ -573,6 +1343,27 @@ static int desc_pre_encode_tx(struct stream_entry *e)
 	return i;
 }
 
+/* only the buffer addresses are taken from the entry */
+static int desc_pre_encode_template(struct stream_entry *e,
+				    struct ravb_desc_template *tmpl)
+{
+	struct eavb_entryvec *evec;
+	int i;
+
+	if (tmpl->vecsize > e->msg.vecnum)
+		return 0;
+
+	evec = e->msg.vec;
+
+	for (i = 0; i < tmpl->vecsize; i++, evec++) {
+		e->pre_enc[i] = tmpl->pre_enc[i];
+		e->pre_enc[i].dptr = cpu_to_le32(evec->base);
+		evec->len = le16_to_cpu(tmpl->pre_enc[i].ds) & TX_DS;
+	}
+
+	return i;
+}
+
 static int desc_pre_encode(struct stream_entry *e, bool tx)
 {
 	if (tx)
@@ -593,8 +1384,7 @@ static void desc_copy(struct hwqueue_info *hwq, struct stream_entry *e,
 	struct net_device *ndev = to_net_dev(stp->device.parent);
 	struct device *pdev_dev = ndev->dev.parent;
 #endif
-	int irq_coalesce_frame = (hwq->tx) ?
-				 irq_coalesce_frame_tx : irq_coalesce_frame_rx;
+	int irq_coalesce_frame = hwq->coalesce.frames;
 	u64 dstats_current = 0;
 
 	for (i = 0; i < e->vecsize; i++) {
@@ -920,6 +1710,7 @@ static void stq_release(struct kobject *kobj)
 	struct hwqueue_info *hwq = stq->hwq;
 	struct stream_entry *e, *e1;
 	struct ravb_user_page *userpage, *userpage1;
+	struct ravb_user_dmabuf *udmabuf, *udmabuf1;
 
 	if (hwq->tx)
 		unregister_cbs_param(hwq->index, &stq->cbs, true);
@@ -929,6 +1720,10 @@ static void stq_release(struct kobject *kobj)
 		put_streaming_entry(e);
 	list_for_each_entry_safe(userpage, userpage1, &stq->userpages, list)
 		put_userpage(userpage);
+	list_for_each_entry_safe(udmabuf, udmabuf1, &stq->dmabufs, list)
+		put_user_dmabuf(udmabuf);
+	vfree(stq->ring);
+	vfree(stq->entryPool);
 
 	/* merge statistics values */
 	hwq->pstats.rx_packets += stq->pstats.rx_packets;
@@ -944,13 +1739,21 @@ static void stq_release(struct kobject *kobj)
 static struct kobj_type stq_ktype_rx = {
 	.sysfs_ops = &stq_sysfs_ops,
 	.release = stq_release,
+#if KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE
+	.default_groups = stq_default_groups_rx,
+#else
 	.default_attrs = stq_default_attrs_rx,
+#endif
 };
 
 static struct kobj_type stq_ktype_tx = {
 	.sysfs_ops = &stq_sysfs_ops,
 	.release = stq_release,
+#if KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE
+	.default_groups = stq_default_groups_tx,
+#else
 	.default_attrs = stq_default_attrs_tx,
+#endif
 };
 
 static struct stqueue_info *get_stq(struct hwqueue_info *hwq, int index)
@@ -973,6 +1776,15 @@ static struct stqueue_info *get_stq(struct hwqueue_info *hwq, int index)
 	INIT_LIST_HEAD(&stq->entryWaitQueue);
 	INIT_LIST_HEAD(&stq->entryLogQueue);
 	INIT_LIST_HEAD(&stq->userpages);
+	INIT_LIST_HEAD(&stq->dmabufs);
+	INIT_LIST_HEAD(&stq->pendingCmds);
+	INIT_LIST_HEAD(&stq->entryFreeQueue);
+	spin_lock_init(&stq->entryLock);
+
+	if (stq_entry_pool_init(stq)) {
+		kfree(stq);
+		goto no_memory;
+	}
 
 	stq->list.next = LIST_POISON1; /* for debug */
 	stq->list.prev = LIST_POISON2; /* for debug */
@@ -1337,6 +2149,94 @@ static long ravb_get_cbs_info(struct file *file, unsigned long parm)
 	return err;
 }
 
+static long stq_set_entryformat(struct stqueue_info *stq, u32 format)
+{
+	struct hwqueue_info *hwq = stq->hwq;
+	long ret = 0;
+
+	switch (format) {
+	case EAVB_ENTRYFORMAT_DEFAULT:
+	case EAVB_ENTRYFORMAT_SG:
+		break;
+	case EAVB_ENTRYFORMAT_TIMED:
+		if (hwq->tx)
+			break;
+		/* fall through */
+	default:
+		pr_err("%s failure: wrong entry format: %u\n", __func__, format);
+		return -EINVAL;
+	}
+
+	/* entries in flight are returned in the format they came in */
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	if (stq->ring || stq->entrynum.accepted)
+		ret = -EBUSY;
+	else
+		stq->entryformat = format;
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	return ret;
+}
+
+static long stq_set_priority(struct stqueue_info *stq, u32 priority)
+{
+	struct hwqueue_info *hwq = stq->hwq;
+
+	if (!hwq->tx || priority > EAVB_PRIORITY_MAX) {
+		pr_err("%s failure: wrong priority: %u\n", __func__, priority);
+		return -EINVAL;
+	}
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	if (stq->state == AVB_STATE_ACTIVE) {
+		hwq_deactivate_stq(hwq, stq);
+		stq->priority = priority;
+		hwq_activate_stq(hwq, stq);
+	} else {
+		stq->priority = priority;
+	}
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	return 0;
+}
+
+static long stq_set_shaper(struct stqueue_info *stq, u32 enable)
+{
+	struct hwqueue_info *hwq = stq->hwq;
+
+	if (!hwq->tx || enable > 1) {
+		pr_err("%s failure: wrong shaper setting: %u\n",
+		       __func__, enable);
+		return -EINVAL;
+	}
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	stq->shaper.enabled = enable;
+	stq->shaper.blocked = false;
+	stq->shaper.tat = 0;
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	return 0;
+}
+
+static long stq_set_pacing(struct stqueue_info *stq, u32 enable)
+{
+	struct hwqueue_info *hwq = stq->hwq;
+
+	if (!hwq->tx || enable > 1) {
+		pr_err("%s failure: wrong pacing setting: %u\n",
+		       __func__, enable);
+		return -EINVAL;
+	}
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	stq->pacing.enabled = enable;
+	stq->pacing.next = 0;
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	return 0;
+}
+
 static long ravb_set_option_kernel(void *handle, struct eavb_option *option)
 {
 	struct stqueue_info *stq = handle;
@@ -1366,6 +2266,26 @@ static long ravb_set_option_kernel(void *handle, struct eavb_option *option)
 			return -EINVAL;
 		}
 		break;
+	case EAVB_OPTIONID_ENTRYFORMAT:
+		return stq_set_entryformat(stq, option->param);
+	case EAVB_OPTIONID_COMPLETION:
+		switch (option->param) {
+		case EAVB_COMPLETION_ENTRY:
+		case EAVB_COMPLETION_COUNT:
+			stq->completion = option->param;
+			break;
+		default:
+			pr_err("%s failure: wrong completion mode: %u\n",
+			       __func__, option->param);
+			return -EINVAL;
+		}
+		break;
+	case EAVB_OPTIONID_PRIORITY:
+		return stq_set_priority(stq, option->param);
+	case EAVB_OPTIONID_SHAPER:
+		return stq_set_shaper(stq, option->param);
+	case EAVB_OPTIONID_PACING:
+		return stq_set_pacing(stq, option->param);
 	default:
 		return -EINVAL;
 	}
@@ -1403,6 +2323,21 @@ static long ravb_get_option_kernel(void *handle, struct eavb_option *option)
 	case EAVB_OPTIONID_BLOCKMODE:
 		option->param = stq->blockmode;
 		break;
+	case EAVB_OPTIONID_ENTRYFORMAT:
+		option->param = stq->entryformat;
+		break;
+	case EAVB_OPTIONID_COMPLETION:
+		option->param = stq->completion;
+		break;
+	case EAVB_OPTIONID_PRIORITY:
+		option->param = stq->priority;
+		break;
+	case EAVB_OPTIONID_SHAPER:
+		option->param = stq->shaper.enabled;
+		break;
+	case EAVB_OPTIONID_PACING:
+		option->param = stq->pacing.enabled;
+		break;
 	default:
 		pr_err("%s failure: wrong option ID\n", __func__);
 		return -EINVAL;
@@ -1434,12 +2369,290 @@ static long ravb_get_option(struct file *file, unsigned long parm)
 	return 0;
 }
 
-static long ravb_map_page(struct file *file, unsigned long parm)
+static long ravb_set_template_kernel(void *handle,
+				     struct eavb_desctemplate *tmpl)
 {
-	struct streaming_private *stp = stp_ptr;
-	struct ravb_streaming_kernel_if *kif = file->private_data;
-	struct stqueue_info *stq;
-	struct ravb_user_page *userpage;
+	struct stqueue_info *stq = handle;
+	struct ravb_desc_template new = { 0 };
+	struct ravb_tx_desc *desc;
+	int i;
+
+	if (!stq || !tmpl) {
+		pr_err("%s failure: invalid argument\n", __func__);
+		return -EINVAL;
+	}
+
+	if (!stq->hwq->tx || tmpl->vecnum > EAVB_ENTRYVECNUM_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < tmpl->vecnum; i++) {
+		if (!tmpl->len[i] || tmpl->len[i] > TX_DS)
+			return -EINVAL;
+
+		desc = (struct ravb_tx_desc *)&new.pre_enc[i];
+		desc->ds_tagl = cpu_to_le16(tmpl->len[i]);
+		desc->tagh_tsr = 0;
+		desc->dptr = 0;
+		desc->die_dt = ((i == 0) ? DT_FSTART : DT_FMID);
+	}
+
+	if (i)
+		new.pre_enc[i - 1].die_dt = ((i == 1) ? DT_FSINGLE : DT_FEND);
+	new.vecsize = i;
+
+	pr_debug("set_template: %s vecnum=%u\n", stq_name(stq), tmpl->vecnum);
+
+	spin_lock(&stq->entryLock);
+	stq->tmpl = new;
+	spin_unlock(&stq->entryLock);
+
+	return 0;
+}
+
+static long ravb_get_template_kernel(void *handle,
+				     struct eavb_desctemplate *tmpl)
+{
+	struct stqueue_info *stq = handle;
+	struct ravb_desc_template cur;
+	int i;
+
+	if (!stq || !tmpl) {
+		pr_err("%s failure: invalid argument\n", __func__);
+		return -EINVAL;
+	}
+
+	spin_lock(&stq->entryLock);
+	cur = stq->tmpl;
+	spin_unlock(&stq->entryLock);
+
+	memset(tmpl, 0, sizeof(*tmpl));
+	tmpl->vecnum = cur.vecsize;
+	for (i = 0; i < cur.vecsize; i++)
+		tmpl->len[i] = le16_to_cpu(cur.pre_enc[i].ds) & TX_DS;
+
+	return 0;
+}
+
+static long ravb_set_template(struct file *file, unsigned long parm)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct eavb_desctemplate tmpl;
+	char __user *buf = (char __user *)parm;
+
+	if (copy_from_user(&tmpl, buf, sizeof(tmpl)))
+		return -EFAULT;
+
+	return ravb_set_template_kernel(kif->handle, &tmpl);
+}
+
+static long ravb_get_template(struct file *file, unsigned long parm)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct eavb_desctemplate tmpl;
+	char __user *buf = (char __user *)parm;
+	long ret;
+
+	ret = ravb_get_template_kernel(kif->handle, &tmpl);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(buf, &tmpl, sizeof(tmpl)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * gate control list
+ *
+ * gate.timer steps through the list on CLOCK_TAI and publishes the open
+ * priority levels in gate.mask, the encoder only serves stream queues of
+ * open levels. Frames already in the ring are not recalled when a gate
+ * closes, burst limits bound how far they reach into the next window.
+ */
+static enum hrtimer_restart ravb_streaming_gate_handler(struct hrtimer *timer)
+{
+	struct gate_info *gate = container_of(timer, struct gate_info, timer);
+	struct hwqueue_info *hwq = container_of(gate, struct hwqueue_info, gate);
+	struct eavb_gcl *gcl = &gate->gcl;
+	u64 start, cycle_end;
+
+	if (gate->index < 0) {
+		gate->index = 0;
+	} else if (++gate->index >= gcl->num ||
+		   gate->entry_end >= gate->cycle_start + gcl->cycle_time) {
+		gate->index = 0;
+		gate->cycle_start += gcl->cycle_time;
+	}
+
+	cycle_end = gate->cycle_start + gcl->cycle_time;
+	start = gate->index ? gate->entry_end : gate->cycle_start;
+	if (gate->index == gcl->num - 1)
+		gate->entry_end = cycle_end;
+	else
+		gate->entry_end = min(start + gcl->entry[gate->index].interval,
+				      cycle_end);
+
+	WRITE_ONCE(gate->mask, gcl->entry[gate->index].gate_mask);
+	hwq_event(hwq, AVB_EVENT_GATE, hwq->chno);
+
+	hrtimer_set_expires(timer, ns_to_ktime(gate->entry_end));
+
+	return HRTIMER_RESTART;
+}
+
+/* Levels a gate control list opens at some point of its cycle */
+static u32 gcl_open_levels(const struct eavb_gcl *gcl)
+{
+	u64 start = 0;
+	u32 levels = 0;
+	int i;
+
+	for (i = 0; i < gcl->num && start < gcl->cycle_time; i++) {
+		levels |= gcl->entry[i].gate_mask;
+		start += gcl->entry[i].interval;
+	}
+
+	return levels;
+}
+
+static long ravb_set_gcl_kernel(void *handle, struct eavb_gcl *gcl)
+{
+	struct stqueue_info *stq = handle;
+	struct hwqueue_info *hwq;
+	struct gate_info *gate;
+	u64 now, cycles;
+	u32 levels;
+	int i, qno;
+
+	if (!stq || !gcl) {
+		pr_err("%s failure: invalid argument\n", __func__);
+		return -EINVAL;
+	}
+
+	hwq = stq->hwq;
+	if (!hwq->tx) {
+		pr_err("%s failure: not permitted for rx\n", __func__);
+		return -EPERM;
+	}
+
+	if (gcl->num > EAVB_GCL_MAX)
+		return -EINVAL;
+
+	if (gcl->num && gcl->cycle_time < RAVB_GCL_INTERVAL_MIN)
+		return -EINVAL;
+
+	for (i = 0; i < gcl->num; i++) {
+		if (gcl->entry[i].interval < RAVB_GCL_INTERVAL_MIN ||
+		    gcl->entry[i].gate_mask & ~RAVB_GATE_ALL_OPEN)
+			return -EINVAL;
+	}
+
+	pr_debug("set_gcl: %s num=%u cycle=%u\n",
+		 hwq_name(hwq), gcl->num, gcl->cycle_time);
+
+	gate = &hwq->gate;
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+
+	/* no stream queue may be starved by the list */
+	if (gcl->num) {
+		levels = gcl_open_levels(gcl);
+		for_each_set_bit(qno, hwq->stream_map, RAVB_STQUEUE_NUM) {
+			if (levels & BIT(hwq->stqueueInfoTable[qno]->priority))
+				continue;
+			pr_err("%s failure: %s level %u never opens\n",
+			       __func__,
+			       stq_name(hwq->stqueueInfoTable[qno]),
+			       hwq->stqueueInfoTable[qno]->priority);
+			avb_up(&hwq->sem, hwq->index, stq->qno);
+			return -EINVAL;
+		}
+	}
+
+	hrtimer_cancel(&gate->timer);
+
+	gate->gcl = *gcl;
+	gate->index = -1;
+	WRITE_ONCE(gate->mask, RAVB_GATE_ALL_OPEN);
+
+	if (gcl->num) {
+		/* a base_time in the past starts on the next cycle */
+		gate->cycle_start = gcl->base_time;
+		now = ktime_to_ns(ktime_get_clocktai());
+		if (gate->cycle_start < now) {
+			cycles = div64_u64(now - gate->cycle_start +
+					   gcl->cycle_time - 1,
+					   gcl->cycle_time);
+			gate->cycle_start += cycles * gcl->cycle_time;
+		}
+		hrtimer_start(&gate->timer, ns_to_ktime(gate->cycle_start),
+			      HRTIMER_MODE_ABS);
+	}
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	hwq_event(hwq, AVB_EVENT_GATE, hwq->chno);
+
+	return 0;
+}
+
+static long ravb_get_gcl_kernel(void *handle, struct eavb_gcl *gcl)
+{
+	struct stqueue_info *stq = handle;
+	struct hwqueue_info *hwq;
+
+	if (!stq || !gcl) {
+		pr_err("%s failure: invalid argument\n", __func__);
+		return -EINVAL;
+	}
+
+	hwq = stq->hwq;
+	if (!hwq->tx) {
+		pr_err("%s failure: not permitted for rx\n", __func__);
+		return -EPERM;
+	}
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	*gcl = hwq->gate.gcl;
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	return 0;
+}
+
+static long ravb_set_gcl(struct file *file, unsigned long parm)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct eavb_gcl gcl;
+	char __user *buf = (char __user *)parm;
+
+	if (copy_from_user(&gcl, buf, sizeof(gcl)))
+		return -EFAULT;
+
+	return ravb_set_gcl_kernel(kif->handle, &gcl);
+}
+
+static long ravb_get_gcl(struct file *file, unsigned long parm)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct eavb_gcl gcl;
+	char __user *buf = (char __user *)parm;
+	long ret;
+
+	ret = ravb_get_gcl_kernel(kif->handle, &gcl);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(buf, &gcl, sizeof(gcl)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long ravb_map_page(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq;
+	struct ravb_user_page *userpage;
 	struct eavb_dma_alloc dma;
 	char __user *buf = (char __user *)parm;
 	long err = 0;
@@ -1461,10 +2674,10 @@ static long ravb_map_page(struct file *file, unsigned long parm)
 		goto failed;
 	}
 
-	if ((u64)userpage->page_dma >= 0x100000000UL)
+	if ((u64)userpage->region.dma >= 0x100000000UL)
 		pr_warn("map_page: 32bit over address(page_dma=%pad)\n",
-			&userpage->page_dma);
-	dma.dma_paddr = cpu_to_le32((u32)userpage->page_dma);
+			&userpage->region.dma);
+	dma.dma_paddr = cpu_to_le32((u32)userpage->region.dma);
 	dma.mmap_size = PAGE_SIZE;
 
 	if (copy_to_user(buf, &dma, sizeof(dma))) {
@@ -1475,11 +2688,12 @@ static long ravb_map_page(struct file *file, unsigned long parm)
 	}
 
 	avb_down(&stp->sem, -1, -1);
-	if (stq)
-		list_add_tail(&userpage->list, &stq->userpages);
-	else
-		list_add_tail(&userpage->list, &stp->userpages);
+	err = add_userpage(stq, userpage);
 	avb_up(&stp->sem, -1, -1);
+	if (err) {
+		put_userpage(userpage);
+		goto failed;
+	}
 
 	pr_debug("map_page: %p %08x %d\n", userpage->page,
 		 dma.dma_paddr, dma.mmap_size);
@@ -1522,6 +2736,9 @@ static long ravb_unmap_page(struct file *file, unsigned long parm)
 		err = -EINVAL;
 		goto failed;
 	}
+	err = retire_region(&userpage->region);
+	if (err)
+		goto failed;
 	put_userpage(userpage);
 
 failed:
@@ -1529,93 +2746,437 @@ failed:
 	return err;
 }
 
-static int ravb_streaming_read_stq_kernel(void *handle,
-					  struct eavb_entry *buf,
-					  unsigned int num);
-static int ravb_streaming_write_stq_kernel(void *handle,
-					   struct eavb_entry *buf,
-					   unsigned int num);
-
-int ravb_streaming_open_stq_kernel(enum AVB_DEVNAME dev_name,
-				   struct ravb_streaming_kernel_if *kif,
-				   unsigned int flags)
+static long ravb_map_pool(struct file *file, unsigned long parm)
 {
 	struct streaming_private *stp = stp_ptr;
-	struct net_device *ndev = to_net_dev(stp->device.parent);
-	struct ravb_private *priv = netdev_priv(ndev);
-	struct hwqueue_info *hwq;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
 	struct stqueue_info *stq;
-	int index, qno, n_queues;
+	struct ravb_user_page *userpage;
+	struct eavb_dma_pool pool;
+	char __user *buf = (char __user *)parm;
+	long err = 0;
 
-	if (!kif) {
-		pr_err("%s failure: kif is null\n", __func__);
-		return -EINVAL;
-	}
+	if (kif)
+		stq = kif->handle;
+	else
+		stq = NULL;
 
-	index = dev_name;
-	if (index >= RAVB_HWQUEUE_NUM || index < 0) {
-		pr_err("%s failure: invalid index: %d\n", __func__, index);
-		return -ENODEV;
+	if (copy_from_user(&pool, buf, sizeof(pool))) {
+		pr_err("map_pool: copy from user failed\n");
+		err = -EFAULT;
+		goto failed;
 	}
 
-	hwq = &stp->hwqueueInfoTable[index];
-	n_queues = (hwq->tx) ? RAVB_STQUEUE_NUM : 1;
+#if KERNEL_VERSION(5, 10, 0) > LINUX_VERSION_CODE
+	/* contiguous pools need dma_alloc_pages */
+	err = -EOPNOTSUPP;
+	goto failed;
+#endif
 
-	avb_down(&hwq->sem, hwq->index, -1);
-	qno = find_first_zero_bit(hwq->stream_map, n_queues);
-	if (!(qno < n_queues)) {
-		avb_up(&hwq->sem, hwq->index, -1);
-		pr_err("too many queues, qno=%d, n_queues=%d\n", qno, n_queues);
-		return -EBUSY;
+	if (!pool.size || pool.size > RAVB_USERPOOL_SIZE_MAX) {
+		err = -EINVAL;
+		goto failed;
 	}
 
-	stq = get_stq(hwq, qno);
-	if (!stq) {
-		avb_up(&hwq->sem, hwq->index, -1);
-		pr_err("failed to get stq info\n");
-		return -ENOMEM;
+	userpage = get_userpool(PAGE_ALIGN((size_t)pool.size));
+	if (unlikely(!userpage)) {
+		err = -ENOMEM;
+		goto failed;
 	}
 
-	kif->handle = stq;
-	kif->read = &ravb_streaming_read_stq_kernel;
-	kif->write = &ravb_streaming_write_stq_kernel;
-	kif->set_txparam = &ravb_set_txparam_kernel;
-	kif->get_txparam = &ravb_get_txparam_kernel;
-	kif->set_rxparam = &ravb_set_rxparam_kernel;
-	kif->get_rxparam = &ravb_get_rxparam_kernel;
-	kif->set_option = &ravb_set_option_kernel;
-	kif->get_option = &ravb_get_option_kernel;
-	kif->get_entrynum = &ravb_get_entrynum_kernel;
-	kif->get_linkspeed = &ravb_get_linkspeed;
-	kif->blocking_cancel = &ravb_blocking_cancel_kernel;
-
-	stq->flags = flags;
-
-	hwq->stqueueInfoTable[qno] = stq;
-	set_bit(qno, hwq->stream_map);
+	if ((u64)userpage->region.dma + userpage->region.size > 0x100000000UL)
+		pr_warn("map_pool: 32bit over address(page_dma=%pad)\n",
+			&userpage->region.dma);
+	pool.dma_paddr = (u32)userpage->region.dma;
+	pool.size = userpage->region.size;
 
-	/* reset decriptor count if hw incorrect state */
-	if (ravb_read(ndev, CDAR0 + (hwq->qno * sizeof(u32))) ==
-	    (u32)(priv->desc_bat_dma + (sizeof(struct ravb_desc) * hwq->qno))) {
-		hwq->curr = 0;
-		hwq->remain = hwq->ringsize;
+	if (copy_to_user(buf, &pool, sizeof(pool))) {
+		pr_err("map_pool: copyout to user failed\n");
+		put_userpage(userpage);
+		err = -EFAULT;
+		goto failed;
 	}
 
-	avb_up(&hwq->sem, hwq->index, -1);
+	avb_down(&stp->sem, -1, -1);
+	err = add_userpage(stq, userpage);
+	avb_up(&stp->sem, -1, -1);
+	if (err) {
+		put_userpage(userpage);
+		goto failed;
+	}
 
-	pr_debug("open: %s\n", stq_name(stq));
+	pr_debug("map_pool: %p %08x %u\n", userpage->page,
+		 pool.dma_paddr, pool.size);
 
 	return 0;
-}
-EXPORT_SYMBOL(ravb_streaming_open_stq_kernel);
-static int ravb_streaming_open_stq(struct inode *inode, struct file *file)
-{
-	struct ravb_streaming_kernel_if *kif;
-	int ret;
 
-	kif = kzalloc(sizeof(*kif), GFP_KERNEL);
+failed:
+	pr_err("%s failed, err=%ld\n", __func__, err);
 
-	if (!kif)
+	return err;
+}
+
+static long ravb_unmap_pool(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq;
+	struct ravb_user_page *userpage;
+	struct eavb_dma_pool pool;
+	char __user *buf = (char __user *)parm;
+	long err = 0;
+
+	if (kif)
+		stq = kif->handle;
+	else
+		stq = NULL;
+
+	if (copy_from_user(&pool, buf, sizeof(pool)))
+		return -EFAULT;
+
+	pr_debug("unmap_pool: %08x %u\n", pool.dma_paddr, pool.size);
+
+	avb_down(&stp->sem, -1, -1);
+
+	userpage = lookup_userpage(stq, pool.dma_paddr);
+	if (!userpage || !userpage->chunk_map) {
+		err = -EINVAL;
+		goto failed;
+	}
+	err = retire_region(&userpage->region);
+	if (err)
+		goto failed;
+	put_userpage(userpage);
+
+failed:
+	avb_up(&stp->sem, -1, -1);
+	return err;
+}
+
+static long ravb_attach_dmabuf(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+	struct ravb_user_dmabuf *udmabuf;
+	struct eavb_dmabuf arg;
+	char __user *buf = (char __user *)parm;
+	int err;
+
+	if (copy_from_user(&arg, buf, sizeof(arg)))
+		return -EFAULT;
+
+	udmabuf = get_user_dmabuf(arg.fd);
+	if (IS_ERR(udmabuf)) {
+		pr_err("attach_dmabuf: %s failed to attach fd=%d, err=%ld\n",
+		       stq_name(stq), arg.fd, PTR_ERR(udmabuf));
+		return PTR_ERR(udmabuf);
+	}
+
+	arg.dma_paddr = (u32)udmabuf->region.dma;
+	arg.size = udmabuf->region.size;
+
+	if (copy_to_user(buf, &arg, sizeof(arg))) {
+		put_user_dmabuf(udmabuf);
+		return -EFAULT;
+	}
+
+	avb_down(&stp->sem, -1, -1);
+	udmabuf->region.owner = stq;
+	err = insert_region(&udmabuf->region);
+	if (!err)
+		list_add_tail(&udmabuf->list, &stq->dmabufs);
+	avb_up(&stp->sem, -1, -1);
+	if (err) {
+		pr_err("attach_dmabuf: %s range %08x+%u already mapped\n",
+		       stq_name(stq), arg.dma_paddr, arg.size);
+		put_user_dmabuf(udmabuf);
+		return err;
+	}
+
+	pr_debug("attach_dmabuf: %s fd=%d %08x %u\n", stq_name(stq),
+		 arg.fd, arg.dma_paddr, arg.size);
+
+	return 0;
+}
+
+static long ravb_detach_dmabuf(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+	struct ravb_user_dmabuf *udmabuf;
+	struct eavb_dmabuf arg;
+	char __user *buf = (char __user *)parm;
+	long err = -EINVAL;
+
+	if (copy_from_user(&arg, buf, sizeof(arg)))
+		return -EFAULT;
+
+	pr_debug("detach_dmabuf: %s %08x\n", stq_name(stq), arg.dma_paddr);
+
+	avb_down(&stp->sem, -1, -1);
+	list_for_each_entry(udmabuf, &stq->dmabufs, list) {
+		if (udmabuf->region.dma == arg.dma_paddr) {
+			err = retire_region(&udmabuf->region);
+			if (!err)
+				put_user_dmabuf(udmabuf);
+			break;
+		}
+	}
+	avb_up(&stp->sem, -1, -1);
+
+	return err;
+}
+
+static long ravb_export_dmabuf(struct file *file, unsigned long parm)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq;
+	struct ravb_user_page *userpage;
+	struct dma_buf *dmabuf;
+	struct eavb_dmabuf arg;
+	char __user *buf = (char __user *)parm;
+	int fd;
+
+	if (kif)
+		stq = kif->handle;
+	else
+		stq = NULL;
+
+	if (copy_from_user(&arg, buf, sizeof(arg)))
+		return -EFAULT;
+
+	avb_down(&stp->sem, -1, -1);
+	userpage = lookup_userpage(stq, arg.dma_paddr);
+	if (userpage)
+		kref_get(&userpage->ref);
+	avb_up(&stp->sem, -1, -1);
+
+	if (!userpage)
+		return -EINVAL;
+
+	exp_info.ops = &userpage_dmabuf_ops;
+	exp_info.size = userpage->region.size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = userpage;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		kref_put(&userpage->ref, userpage_release);
+		return PTR_ERR(dmabuf);
+	}
+
+	/* the fd goes live only once the caller has been told about it */
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+
+	arg.fd = fd;
+	arg.size = userpage->region.size;
+
+	pr_debug("export_dmabuf: %08x %u fd=%d\n", arg.dma_paddr,
+		 arg.size, arg.fd);
+
+	if (copy_to_user(buf, &arg, sizeof(arg))) {
+		put_unused_fd(fd);
+		dma_buf_put(dmabuf);
+		return -EFAULT;
+	}
+
+	fd_install(fd, dmabuf->file);
+
+	return 0;
+}
+
+static long ravb_pool_alloc(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq;
+	struct ravb_user_page *userpage;
+	struct eavb_dma_chunk chunk;
+	char __user *buf = (char __user *)parm;
+	dma_addr_t chunk_dma = 0;
+	int err = -EINVAL;
+
+	if (kif)
+		stq = kif->handle;
+	else
+		stq = NULL;
+
+	if (copy_from_user(&chunk, buf, sizeof(chunk)))
+		return -EFAULT;
+
+	if (!chunk.size)
+		return -EINVAL;
+
+	avb_down(&stp->sem, -1, -1);
+	userpage = lookup_userpage(stq, chunk.pool_paddr);
+	if (userpage && userpage->chunk_map)
+		err = userpool_alloc(userpage, chunk.size, &chunk_dma);
+	avb_up(&stp->sem, -1, -1);
+
+	if (err)
+		return err;
+
+	chunk.dma_paddr = (u32)chunk_dma;
+
+	pr_debug("pool_alloc: %08x %08x %u\n", chunk.pool_paddr,
+		 chunk.dma_paddr, chunk.size);
+
+	if (copy_to_user(buf, &chunk, sizeof(chunk))) {
+		avb_down(&stp->sem, -1, -1);
+		userpool_free(userpage, chunk_dma, chunk.size);
+		avb_up(&stp->sem, -1, -1);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long ravb_pool_free(struct file *file, unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq;
+	struct ravb_user_page *userpage;
+	struct eavb_dma_chunk chunk;
+	char __user *buf = (char __user *)parm;
+	long err = -EINVAL;
+
+	if (kif)
+		stq = kif->handle;
+	else
+		stq = NULL;
+
+	if (copy_from_user(&chunk, buf, sizeof(chunk)))
+		return -EFAULT;
+
+	pr_debug("pool_free: %08x %08x %u\n", chunk.pool_paddr,
+		 chunk.dma_paddr, chunk.size);
+
+	avb_down(&stp->sem, -1, -1);
+	userpage = lookup_userpage(stq, chunk.pool_paddr);
+	if (userpage && userpage->chunk_map) {
+		if (range_in_flight(userpage->region.owner, chunk.dma_paddr,
+				    (dma_addr_t)chunk.dma_paddr + chunk.size))
+			err = -EBUSY;
+		else
+			err = userpool_free(userpage, chunk.dma_paddr,
+					    chunk.size);
+	}
+	avb_up(&stp->sem, -1, -1);
+
+	return err;
+}
+
+static int ravb_streaming_read_stq_kernel(void *handle,
+					  struct eavb_entry *buf,
+					  unsigned int num);
+static int ravb_streaming_write_stq_kernel(void *handle,
+					   struct eavb_entry *buf,
+					   unsigned int num);
+static int ravb_streaming_read_sg_stq_kernel(void *handle,
+					     struct eavb_entry_sg *buf,
+					     unsigned int num);
+static int ravb_streaming_write_sg_stq_kernel(void *handle,
+					      struct eavb_entry_sg *buf,
+					      unsigned int num);
+static void stq_uring_complete(struct stqueue_info *stq, long result);
+
+int ravb_streaming_open_stq_kernel(enum AVB_DEVNAME dev_name,
+				   struct ravb_streaming_kernel_if *kif,
+				   unsigned int flags)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct net_device *ndev = to_net_dev(stp->device.parent);
+	struct ravb_private *priv = netdev_priv(ndev);
+	struct hwqueue_info *hwq;
+	struct stqueue_info *stq;
+	int index, qno, n_queues;
+
+	if (!kif) {
+		pr_err("%s failure: kif is null\n", __func__);
+		return -EINVAL;
+	}
+
+	index = dev_name;
+	if (index >= RAVB_HWQUEUE_NUM || index < 0) {
+		pr_err("%s failure: invalid index: %d\n", __func__, index);
+		return -ENODEV;
+	}
+
+	hwq = &stp->hwqueueInfoTable[index];
+	n_queues = (hwq->tx) ? RAVB_STQUEUE_NUM : 1;
+
+	avb_down(&hwq->sem, hwq->index, -1);
+	qno = find_first_zero_bit(hwq->stream_map, n_queues);
+	if (!(qno < n_queues)) {
+		avb_up(&hwq->sem, hwq->index, -1);
+		pr_err("too many queues, qno=%d, n_queues=%d\n", qno, n_queues);
+		return -EBUSY;
+	}
+
+	stq = get_stq(hwq, qno);
+	if (!stq) {
+		avb_up(&hwq->sem, hwq->index, -1);
+		pr_err("failed to get stq info\n");
+		return -ENOMEM;
+	}
+
+	kif->handle = stq;
+	kif->read = &ravb_streaming_read_stq_kernel;
+	kif->write = &ravb_streaming_write_stq_kernel;
+	kif->set_txparam = &ravb_set_txparam_kernel;
+	kif->get_txparam = &ravb_get_txparam_kernel;
+	kif->set_rxparam = &ravb_set_rxparam_kernel;
+	kif->get_rxparam = &ravb_get_rxparam_kernel;
+	kif->set_option = &ravb_set_option_kernel;
+	kif->get_option = &ravb_get_option_kernel;
+	kif->get_entrynum = &ravb_get_entrynum_kernel;
+	kif->get_linkspeed = &ravb_get_linkspeed;
+	kif->blocking_cancel = &ravb_blocking_cancel_kernel;
+	kif->read_sg = &ravb_streaming_read_sg_stq_kernel;
+	kif->write_sg = &ravb_streaming_write_sg_stq_kernel;
+	kif->set_template = &ravb_set_template_kernel;
+	kif->get_template = &ravb_get_template_kernel;
+	kif->set_gcl = &ravb_set_gcl_kernel;
+	kif->get_gcl = &ravb_get_gcl_kernel;
+
+	stq->flags = flags;
+
+	hwq->stqueueInfoTable[qno] = stq;
+	set_bit(qno, hwq->stream_map);
+	if (hwq->sched->attach)
+		hwq->sched->attach(hwq, stq);
+
+	/* reset decriptor count if hw incorrect state */
+	if (ravb_read(ndev, CDAR0 + (hwq->qno * sizeof(u32))) ==
+	    (u32)(priv->desc_bat_dma + (sizeof(struct ravb_desc) * hwq->qno))) {
+		hwq->curr = 0;
+		hwq->remain = hwq->ringsize;
+	}
+
+	avb_up(&hwq->sem, hwq->index, -1);
+
+	pr_debug("open: %s\n", stq_name(stq));
+
+	return 0;
+}
+EXPORT_SYMBOL(ravb_streaming_open_stq_kernel);
+static int ravb_streaming_open_stq(struct inode *inode, struct file *file)
+{
+	struct ravb_streaming_kernel_if *kif;
+	int ret;
+
+	kif = kzalloc(sizeof(*kif), GFP_KERNEL);
+
+	if (!kif)
 		return -ENOMEM;
 
 	ret = ravb_streaming_open_stq_kernel((enum AVB_DEVNAME)(iminor(inode)),
@@ -1625,6 +3186,9 @@ static int ravb_streaming_open_stq(struct inode *inode, struct file *file)
 		return ret;
 	}
 
+	/* entries from userspace must point into its own buffers */
+	((struct stqueue_info *)kif->handle)->userspace = true;
+
 	file->private_data = kif;
 
 	return 0;
@@ -1656,6 +3220,10 @@ int ravb_streaming_release_stq_kernel(void *handle)
 	 * wait complete all entry processed.
 	 */
 	avb_down(&hwq->sem, hwq->index, stq->qno);
+	stq_uring_complete(stq, -ECANCELED);
+	/* held and gated entries are sent now instead of blocking close */
+	stq->detaching = true;
+	hwq->detaching++;
 	switch (stq->state) {
 	case AVB_STATE_ACTIVE:
 	case AVB_STATE_WAITCOMPLETE:
@@ -1673,6 +3241,9 @@ int ravb_streaming_release_stq_kernel(void *handle)
 		break;
 	}
 
+	hwq->detaching--;
+	if (hwq->sched->detach)
+		hwq->sched->detach(hwq, stq);
 	clear_bit(stq->qno, hwq->stream_map);
 	avb_up(&hwq->sem, hwq->index, stq->qno);
 
@@ -1705,62 +3276,101 @@ static int ravb_streaming_release(struct inode *inode, struct file *file)
 	return ravb_streaming_release_stq(inode, file);
 }
 
-static int ravb_streaming_read_stq_kernel(void *handle,
-					  struct eavb_entry *buf,
-					  unsigned int num)
+/**
+ * stream queue entry operations
+ */
+static inline size_t eavb_entry_size(enum eavb_entryformat format)
 {
-	struct stqueue_info *stq = handle;
-	struct hwqueue_info *hwq;
-	struct stream_entry *e;
-	int i;
-	int err;
-
-	if (!stq)
-		return -EINVAL;
-
-	if (!buf)
-		return -EINVAL;
-
-	pr_debug("read: %s > num=%d\n", stq_name(stq), num);
-
-	if (!num)
-		return 0;
-
-	if (stq->blockmode == EAVB_BLOCK_WAITALL &&
-	    num > RAVB_ENTRY_THRETH)
-		return -ENOMEM;
-
-	hwq = stq->hwq;
-
-	avb_down(&hwq->sem, hwq->index, stq->qno);
-	stq->cancel = false;
-	if (!is_readable_count(stq, num)) {
-		avb_up(&hwq->sem, hwq->index, stq->qno);
+	switch (format) {
+	case EAVB_ENTRYFORMAT_SG:
+		return sizeof(struct eavb_entry_sg);
+	case EAVB_ENTRYFORMAT_TIMED:
+		return sizeof(struct eavb_entry_timed);
+	default:
+		return sizeof(struct eavb_entry);
+	}
+}
 
-		if (stq->flags & O_NONBLOCK)
-			return -EAGAIN;
+/* number of entries copied through stq->ebuf at once */
+static inline unsigned int stq_ebuf_num(struct stqueue_info *stq,
+					enum eavb_entryformat format)
+{
+	return sizeof(stq->ebuf) / eavb_entry_size(format);
+}
 
-		err = avb_wait_event_interruptible(
-			stq->waitEvent,
-			is_readable_count(stq, num) || stq->cancel,
-			hwq->index, stq->qno);
-		if (err < 0) {
-			pr_err("%s: failed to wait, err=%d\n", __func__, err);
-			return -EINTR;
-		}
+static void entry_import(struct stream_entry *e, const void *buf,
+			 enum eavb_entryformat format)
+{
+	const struct eavb_entry *entry = buf;
+	const struct eavb_entry_timed *timed = buf;
+
+	e->launch_time = 0;
+
+	switch (format) {
+	case EAVB_ENTRYFORMAT_TIMED:
+		e->launch_time = timed->launch_time;
+		buf = &timed->entry;
+		/* fall through */
+	case EAVB_ENTRYFORMAT_SG:
+		memcpy(&e->msg, buf, sizeof(struct eavb_entry_sg));
+		/* vecnum out of range makes the entry invalid */
+		if (e->msg.vecnum > EAVB_ENTRYVECNUM_MAX)
+			e->msg.vecnum = 0;
+		break;
+	default:
+		e->msg.seq_no = entry->seq_no;
+		e->msg.vecnum = EAVB_ENTRYVECNUM;
+		memcpy(e->msg.vec, entry->vec, sizeof(entry->vec));
+		break;
+	}
+}
 
-		avb_down(&hwq->sem, hwq->index, stq->qno);
+static void entry_export(void *buf, struct stream_entry *e,
+			 enum eavb_entryformat format)
+{
+	struct eavb_entry *entry = buf;
+	struct eavb_entry_timed *timed = buf;
+
+	switch (format) {
+	case EAVB_ENTRYFORMAT_TIMED:
+		timed->launch_time = e->launch_time;
+		buf = &timed->entry;
+		/* fall through */
+	case EAVB_ENTRYFORMAT_SG:
+		memcpy(buf, &e->msg, sizeof(struct eavb_entry_sg));
+		break;
+	default:
+		entry->seq_no = e->msg.seq_no;
+		memcpy(entry->vec, e->msg.vec, sizeof(entry->vec));
+		break;
 	}
+}
+
+/* Caller must hold hwq->sem, a NULL buf only recycles the entries */
+static int stq_reap_entries(struct stqueue_info *stq,
+			    void *buf,
+			    unsigned int num,
+			    enum eavb_entryformat format)
+{
+	struct hwqueue_info *hwq = stq->hwq;
+	struct stream_entry *e;
+	struct ravb_cachesync sync;
+	size_t size = eavb_entry_size(format);
+	int i;
 
+	cachesync_init(&sync, hwq->tx);
 	num = min_t(u32, (u32)num, stq->entrynum.completed);
 	for (i = 0; i < num; i++) {
 		e = list_first_entry(&stq->entryLogQueue,
 				     struct stream_entry, list);
-		memcpy(buf + i, &e->msg, sizeof(struct eavb_entry));
+		if (buf)
+			entry_export(buf + i * size, e, format);
 		if (!uncached_access(stq))
-			cachesync_streaming_entry(e);
+			cachesync_add_entry(&sync, e);
 		put_streaming_entry(e);
 	}
+	cachesync_flush(&sync);
+	cachesync_account(stq, &sync);
 
 	stq->entrynum.accepted -= i;
 	stq->entrynum.completed -= i;
@@ -1782,643 +3392,2286 @@ static int ravb_streaming_read_stq_kernel(void *handle,
 		}
 	}
 
-	avb_up(&hwq->sem, hwq->index, stq->qno);
-	avb_wake_up_interruptible(&stq->waitEvent, hwq->index, stq->qno);
-
-	pr_debug("read: %s < num=%d\n", stq_name(stq), i);
-
 	return i;
 }
 
-static ssize_t ravb_streaming_read_stq(struct file *file,
-				       char __user *buf,
-				       size_t count, loff_t *ppos)
+static bool stq_validate_entry(struct stqueue_info *stq,
+			       struct stream_entry *e)
 {
-	struct ravb_streaming_kernel_if *kif = file->private_data;
-	struct stqueue_info *stq = kif->handle;
-	int num;
-	unsigned int fraction;
-	unsigned long ret;
-	ssize_t rsize;
-
-	stq->flags = file->f_flags;
-	num = count / sizeof(struct eavb_entry);
-	fraction = count % sizeof(struct eavb_entry);
-
-	pr_debug("read: %s < count=%zd, fraction=%d\n",
-		 stq_name(stq), count, fraction);
-
-	if (fraction) {
-		pr_err("incorrect data size: %u\n", fraction);
-		return -EINVAL;
-	}
-
-	num = ravb_streaming_read_stq_kernel(stq, stq->ebuf, num);
-	if (num <= 0)
-		return (ssize_t)num;
+	struct streaming_private *stp = stp_ptr;
+	struct eavb_entryvec *evec = e->msg.vec;
+	unsigned long flags;
+	bool valid = true;
+	int i;
 
-	ret = copy_to_user(buf, stq->ebuf,
-			   num * sizeof(struct eavb_entry));
-	if (ret) {
-		pr_err("read: %s copy to user failed\n", stq_name(stq));
-		return -EFAULT;
+	spin_lock_irqsave(&stp->region_lock, flags);
+	for (i = 0; i < e->vecsize; i++, evec++) {
+		if (!evec->base) {
+			/* RX may discard the data, TX only may end the list */
+			if (stq->hwq->tx && evec->len)
+				valid = false;
+		} else if (!validate_entryvec(stq, evec)) {
+			valid = false;
+		}
+		if (!valid)
+			break;
 	}
+	spin_unlock_irqrestore(&stp->region_lock, flags);
 
-	rsize = num * sizeof(struct eavb_entry);
-	pr_debug("read: %s < count=%zd\n", stq_name(stq), rsize);
-
-	return rsize;
-}
-
-static ssize_t ravb_streaming_read(struct file *file,
-				   char __user *buf,
-				   size_t count, loff_t *ppos)
-{
-	if (!file->private_data)
-		return -EPERM;
-
-	return ravb_streaming_read_stq(file, buf, count, ppos);
+	return valid;
 }
 
-static int ravb_streaming_write_stq_kernel(void *handle,
-					   struct eavb_entry *buf,
-					   unsigned int num)
+/*
+ * Returns the number of entries consumed from buf, which includes
+ * the invalid entries dropped on the way. The number of entries
+ * queued to entry_queue is returned in *queued.
+ */
+static int stq_prepare_entries(struct stqueue_info *stq,
+			       void *buf,
+			       unsigned int num,
+			       enum eavb_entryformat format,
+			       struct list_head *entry_queue,
+			       unsigned int *queued,
+			       struct ravb_cachesync *sync)
 {
-	struct stqueue_info *stq = handle;
-	struct hwqueue_info *hwq;
 	struct stream_entry *e;
-	struct list_head entry_queue;
+	struct ravb_desc_template tmpl;
+	size_t size = eavb_entry_size(format);
 	int i;
-	int err;
-
-	if (!stq)
-		return -EINVAL;
-
-	if (!buf)
-		return -EINVAL;
-
-	pr_debug("write: %s > num=%d\n", stq_name(stq), num);
-
-	if (!num)
-		return 0;
-
-	hwq = stq->hwq;
-
-	avb_down(&hwq->sem, hwq->index, stq->qno);
-	stq->cancel = false;
-	if (!is_writeble(stq)) {
-		avb_up(&hwq->sem, hwq->index, stq->qno);
-
-		if (stq->flags & O_NONBLOCK)
-			return -EAGAIN;
-
-		err = avb_wait_event_interruptible(
-			stq->waitEvent,
-			is_writeble(stq) || stq->cancel,
-			hwq->index, stq->qno);
-		if (err < 0) {
-			pr_err("%s: failed to wait, err=%d\n", __func__, err);
-			return -EINTR;
-		}
 
-		avb_down(&hwq->sem, hwq->index, stq->qno);
+	/* snapshot the template once per batch */
+	tmpl.vecsize = 0;
+	if (stq->hwq->tx) {
+		spin_lock(&stq->entryLock);
+		if (stq->tmpl.vecsize)
+			tmpl = stq->tmpl;
+		spin_unlock(&stq->entryLock);
 	}
 
-	num = min_t(u32, (u32)num,
-		    RAVB_ENTRY_THRETH - stq->entrynum.accepted);
-	avb_up(&hwq->sem, hwq->index, stq->qno);
-	/* entry remain is full */
-	if (!num)
-		return 0;
-
-	INIT_LIST_HEAD(&entry_queue);
 	for (i = 0; i < num; i++) {
-		e = get_streaming_entry();
+		e = get_streaming_entry(stq);
 		if (!e)
 			break;
-		memcpy(&e->msg, buf + i, sizeof(struct eavb_entry));
-		e->vecsize = desc_pre_encode(e, stq->hwq->tx);
+		entry_import(e, buf + i * size, format);
+		if (tmpl.vecsize)
+			e->vecsize = desc_pre_encode_template(e, &tmpl);
+		else
+			e->vecsize = desc_pre_encode(e, stq->hwq->tx);
 		if (e->vecsize == 0) {
 			/* TODO countup invalid entry num */
 			pr_warn("write: %s invalid entry(%08x) ignored\n",
 				stq_name(stq), e->msg.seq_no);
 			put_streaming_entry(e);
+		} else if (stq->userspace && !stq_validate_entry(stq, e)) {
+			pr_warn_ratelimited("write: %s entry(%08x) out of mapped buffers, ignored\n",
+					    stq_name(stq), e->msg.seq_no);
+			put_streaming_entry(e);
 		} else {
-			e->stq = stq;
 			if (!uncached_access(stq))
-				cachesync_streaming_entry(e);
+				cachesync_add_entry(sync, e);
 			trace_avb_entry_accept_wrap(e);
-			list_move_tail(&e->list, &entry_queue);
+			list_move_tail(&e->list, entry_queue);
+			(*queued)++;
 		}
 	}
 
-	avb_down(&hwq->sem, hwq->index, stq->qno);
+	/* entries must be synced before they are attached to hwq */
+	cachesync_flush(sync);
+
+	return i;
+}
+
+/* Caller must hold hwq->sem */
+static void stq_attach_entries(struct stqueue_info *stq,
+			       struct list_head *entry_queue,
+			       unsigned int num)
+{
+	struct hwqueue_info *hwq = stq->hwq;
 
-	stq->entrynum.accepted += i;
+	stq->entrynum.accepted += num;
 	if (hwq->tx)
-		stq->dstats.tx_entry_wait += (u64)i;
+		stq->dstats.tx_entry_wait += (u64)num;
 	else
-		stq->dstats.rx_entry_wait += (u64)i;
+		stq->dstats.rx_entry_wait += (u64)num;
 
-	list_splice_tail(&entry_queue, &stq->entryWaitQueue);
+	list_splice_tail(entry_queue, &stq->entryWaitQueue);
+
+	if (list_empty(&stq->entryWaitQueue))
+		return;
 
 	/* if IDLE or WAITCOMPLETE, attach to hwq */
 	if (stq->state == AVB_STATE_IDLE ||
 	    stq->state == AVB_STATE_WAITCOMPLETE) {
+		if (hwq->sched->enqueue)
+			hwq->sched->enqueue(hwq, stq);
 		stq_sequencer(stq, AVB_STATE_ACTIVE);
-		list_add_tail(&stq->list, &hwq->activeStreamQueue);
+		hwq_activate_stq(hwq, stq);
 		hwq_event(hwq, AVB_EVENT_ATTACH, stq->qno);
 	}
+}
 
-	avb_up(&hwq->sem, hwq->index, stq->qno);
+/**
+ * shared memory ring operations
+ *
+ * The ring area consists of struct eavb_ring followed by the submission
+ * and the completion entries, and it is mapped to userspace at
+ * EAVB_RING_MMAP_OFFSET. Submitted entries are taken in and completed
+ * entries are pushed out on each hwqueue task pass, so that a busy
+ * stream queue needs no system call. EAVB_ENTERRING is only needed when
+ * the driver has set EAVB_RING_NEED_WAKEUP.
+ */
+#define RAVB_RING_MASK (RAVB_ENTRY_THRETH - 1)
 
-	pr_debug("write: %s < num=%d\n", stq_name(stq), i);
+static inline bool stq_ring_readable(struct stqueue_info *stq)
+{
+	return stq->cq_tail != READ_ONCE(stq->ring->cq.head);
+}
 
-	return i;
+static inline long stq_ring_cq_count(struct stqueue_info *stq)
+{
+	return (long)(stq->cq_tail - READ_ONCE(stq->ring->cq.head));
 }
 
-static ssize_t ravb_streaming_write_stq(struct file *file,
-					const char __user *buf,
-					size_t count, loff_t *ppos)
+/* Caller must hold hwq->sem */
+static int stq_ring_setup(struct stqueue_info *stq,
+			  struct eavb_ringparam *param)
 {
-	struct ravb_streaming_kernel_if *kif = file->private_data;
-	struct stqueue_info *stq = kif->handle;
-	int num;
-	unsigned int fraction;
-	unsigned long ret;
-	ssize_t wsize;
+	struct eavb_ring *ring;
+	size_t esize = eavb_entry_size(stq->entryformat);
+	size_t size;
 
-	stq->flags = file->f_flags;
-	num = min_t(u32, (u32)(count / sizeof(struct eavb_entry)),
-		    RAVB_ENTRY_THRETH);
-	fraction = count % sizeof(struct eavb_entry);
+	BUILD_BUG_ON_NOT_POWER_OF_2(RAVB_ENTRY_THRETH);
 
-	pr_debug("write: %s < count=%zd, fraction=%d\n",
-		 stq_name(stq), count, fraction);
+	if (stq->ring)
+		return -EBUSY;
 
-	if (fraction) {
-		pr_err("incorrect data size: %u\n", fraction);
-		return -EINVAL;
+	if (stq->state != AVB_STATE_IDLE || stq->entrynum.accepted)
+		return -EBUSY;
+
+	param->entries = RAVB_ENTRY_THRETH;
+	param->sq_off = ALIGN(sizeof(*ring), SMP_CACHE_BYTES);
+	param->cq_off = ALIGN(param->sq_off +
+			      RAVB_ENTRY_THRETH * esize,
+			      SMP_CACHE_BYTES);
+	size = PAGE_ALIGN(param->cq_off + RAVB_ENTRY_THRETH * esize);
+	param->mmap_size = size;
+
+	ring = vmalloc_user(size);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->entries = RAVB_ENTRY_THRETH;
+	ring->flags = EAVB_RING_NEED_WAKEUP;
+
+	stq->sq = (void *)ring + param->sq_off;
+	stq->cq = (void *)ring + param->cq_off;
+	stq->sq_head = 0;
+	stq->cq_tail = 0;
+	stq->ring = ring;
+
+	return 0;
+}
+
+/* Caller must hold hwq->sem */
+static int stq_ring_submit(struct stqueue_info *stq)
+{
+	struct eavb_ring *ring = stq->ring;
+	struct list_head entry_queue;
+	struct ravb_cachesync sync;
+	size_t esize = eavb_entry_size(stq->entryformat);
+	u32 tail, num, room, idx, n;
+	unsigned int queued = 0;
+	int i = 0, ret;
+
+	tail = smp_load_acquire(&ring->sq.tail);
+	num = tail - stq->sq_head;
+	if (num > RAVB_ENTRY_THRETH) {
+		pr_warn_ratelimited("ring: %s invalid sq tail(%u) ignored\n",
+			stq_name(stq), tail);
+		return 0;
 	}
 
-	ret = copy_from_user(stq->ebuf, buf,
-			     num * sizeof(struct eavb_entry));
-	if (ret) {
-		pr_err("write: %s copy from user failed\n", stq_name(stq));
-		return -EFAULT;
+	/* in-flight entries must always find a free completion slot */
+	room = RAVB_ENTRY_THRETH -
+		min_t(u32, stq->cq_tail - READ_ONCE(ring->cq.head),
+		      RAVB_ENTRY_THRETH);
+	room = (room > stq->entrynum.accepted) ?
+		room - stq->entrynum.accepted : 0;
+	num = min_t(u32, num, room);
+	if (!num)
+		return 0;
+
+	INIT_LIST_HEAD(&entry_queue);
+	cachesync_init(&sync, stq->hwq->tx);
+	while (i < num) {
+		idx = (stq->sq_head + i) & RAVB_RING_MASK;
+		n = min_t(u32, num - i, RAVB_ENTRY_THRETH - idx);
+		ret = stq_prepare_entries(stq, stq->sq + idx * esize, n,
+					  stq->entryformat, &entry_queue,
+					  &queued, &sync);
+		i += ret;
+		if (ret < n)
+			break;
 	}
 
-	num = ravb_streaming_write_stq_kernel(stq, stq->ebuf, num);
-	if (num <= 0)
-		return (ssize_t)num;
+	stq_attach_entries(stq, &entry_queue, queued);
+	cachesync_account(stq, &sync);
 
-	wsize = num * sizeof(struct eavb_entry);
-	pr_debug("write: %s < count=%zd\n", stq_name(stq), wsize);
+	stq->sq_head += i;
+	smp_store_release(&ring->sq.head, stq->sq_head);
 
-	return wsize;
+	return i;
 }
 
-static ssize_t ravb_streaming_write(struct file *file,
-				    const char __user *buf,
-				    size_t count, loff_t *ppos)
+/* Caller must hold hwq->sem */
+static int stq_ring_complete(struct stqueue_info *stq)
 {
-	if (!file->private_data)
-		return -EPERM;
+	size_t esize = eavb_entry_size(stq->entryformat);
+	void *cqe;
+	u32 idx, n;
+	int i = 0, ret;
+
+	while (stq->entrynum.completed) {
+		idx = stq->cq_tail & RAVB_RING_MASK;
+		n = min_t(u32, stq->entrynum.completed,
+			  RAVB_ENTRY_THRETH - idx);
+		cqe = count_only(stq) ? NULL : stq->cq + idx * esize;
+		ret = stq_reap_entries(stq, cqe, n, stq->entryformat);
+		stq->cq_tail += ret;
+		i += ret;
+		if (!ret)
+			break;
+	}
 
-	return ravb_streaming_write_stq(file, buf, count, ppos);
+	if (i)
+		smp_store_release(&stq->ring->cq.tail, stq->cq_tail);
+
+	return i;
 }
 
-static unsigned int ravb_streaming_poll_stq(struct file *file,
-					    struct poll_table_struct *wait)
+/* Caller must hold hwq->sem */
+static int stq_ring_service(struct stqueue_info *stq)
 {
-	int ret = 0;
-	struct ravb_streaming_kernel_if *kif = file->private_data;
-	struct stqueue_info *stq = kif->handle;
+	struct eavb_ring *ring = stq->ring;
+	int completed;
 
-	pr_debug("poll: %s r=%d, w=%d\n",
-		 stq_name(stq), is_readable(stq), is_writeble(stq));
-
-	poll_wait(file, &stq->waitEvent, wait);
+	completed = stq_ring_complete(stq);
+	stq_ring_submit(stq);
 
-	if (is_readable(stq))
-		ret |= POLLIN | POLLRDNORM;
+	if (stq->state != AVB_STATE_IDLE) {
+		WRITE_ONCE(ring->flags, ring->flags & ~EAVB_RING_NEED_WAKEUP);
+		return completed;
+	}
 
-	if (is_writeble(stq))
-		ret |= POLLOUT | POLLWRNORM;
+	/* nothing in flight, nobody takes in new entries without a kick */
+	WRITE_ONCE(ring->flags, ring->flags | EAVB_RING_NEED_WAKEUP);
+	smp_mb();
+	if (stq_ring_submit(stq))
+		WRITE_ONCE(ring->flags, ring->flags & ~EAVB_RING_NEED_WAKEUP);
 
-	return ret;
+	return completed;
 }
 
-static unsigned int ravb_streaming_poll(struct file *file,
-					struct poll_table_struct *wait)
+/**
+ * io_uring command operations
+ */
+#if KERNEL_VERSION(5, 19, 0) <= LINUX_VERSION_CODE
+struct ravb_uring_pdu {
+	struct list_head list;
+	struct io_uring_cmd *ioucmd;
+	long result;
+};
+
+static inline struct ravb_uring_pdu *ravb_uring_pdu(struct io_uring_cmd *ioucmd)
 {
-	if (!file->private_data)
-		return 0;
+	BUILD_BUG_ON(sizeof(struct ravb_uring_pdu) > sizeof(ioucmd->pdu));
 
-	return ravb_streaming_poll_stq(file, wait);
+	return (struct ravb_uring_pdu *)ioucmd->pdu;
 }
 
-static void ravb_streaming_vm_open(struct vm_area_struct *vma)
+static inline const void *ravb_uring_cmd_payload(struct io_uring_cmd *ioucmd)
 {
+#if KERNEL_VERSION(6, 6, 0) <= LINUX_VERSION_CODE
+	return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	return ioucmd->cmd;
+#endif
 }
 
-static void ravb_streaming_vm_close(struct vm_area_struct *vma)
+#if KERNEL_VERSION(6, 4, 0) <= LINUX_VERSION_CODE
+static void ravb_uring_cmd_tw(struct io_uring_cmd *ioucmd,
+			      unsigned int issue_flags)
 {
+	io_uring_cmd_done(ioucmd, ravb_uring_pdu(ioucmd)->result, 0,
+			  issue_flags);
 }
-
-#if KERNEL_VERSION(4, 10, 0) <= LINUX_VERSION_CODE
-#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
-static vm_fault_t ravb_streaming_vm_fault(struct vm_fault *vmf)
+#else
+static void ravb_uring_cmd_tw(struct io_uring_cmd *ioucmd)
+{
+	io_uring_cmd_done(ioucmd, ravb_uring_pdu(ioucmd)->result, 0);
+}
+#endif
+
+/* Caller must hold hwq->sem */
+static void stq_uring_complete(struct stqueue_info *stq, long result)
+{
+	struct ravb_uring_pdu *pdu, *pdu1;
+
+	list_for_each_entry_safe(pdu, pdu1, &stq->pendingCmds, list) {
+		/* off the list, a cancel leaves the completion to us */
+		list_del_init(&pdu->list);
+		pdu->result = result;
+		io_uring_cmd_complete_in_task(pdu->ioucmd, ravb_uring_cmd_tw);
+	}
+}
+
+static int ravb_uring_cmd_ring(struct stqueue_info *stq,
+			       struct io_uring_cmd *ioucmd,
+			       unsigned int issue_flags)
+{
+	struct hwqueue_info *hwq = stq->hwq;
+	int completed;
+	long ret;
+
+	if (!stq->ring)
+		return -EINVAL;
+
+	if (issue_flags & IO_URING_F_NONBLOCK) {
+		if (down_trylock(&hwq->sem))
+			return -EAGAIN;
+		trace_avb_sem_take(hwq->index, stq->qno);
+	} else {
+		avb_down(&hwq->sem, hwq->index, stq->qno);
+	}
+
+	completed = stq_ring_service(stq);
+	if (completed)
+		stq_uring_complete(stq, stq_ring_cq_count(stq));
+
+	ret = stq_ring_cq_count(stq);
+	if (!ret && ioucmd->cmd_op == EAVB_WAITRING) {
+#if KERNEL_VERSION(6, 7, 0) <= LINUX_VERSION_CODE
+		/**
+		 * completed from hwqueue task without blocking the caller,
+		 * a parked command pins the file so it must be cancelable
+		 * for the ring to be torn down before release
+		 */
+		ravb_uring_pdu(ioucmd)->ioucmd = ioucmd;
+		list_add_tail(&ravb_uring_pdu(ioucmd)->list, &stq->pendingCmds);
+		io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+		ret = -EIOCBQUEUED;
+#else
+		/* no cancelable commands to park before 6.7 */
+		ret = -EOPNOTSUPP;
+#endif
+	}
+
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	if (completed)
+		avb_wake_up_interruptible(&stq->waitEvent,
+					  hwq->index, stq->qno);
+
+	return ret;
+}
+
+#if KERNEL_VERSION(6, 7, 0) <= LINUX_VERSION_CODE
+/* Complete a parked EAVB_WAITRING torn down by io_uring */
+static int ravb_uring_cmd_cancel(struct stqueue_info *stq,
+				 struct io_uring_cmd *ioucmd,
+				 unsigned int issue_flags)
+{
+	struct hwqueue_info *hwq = stq->hwq;
+	struct ravb_uring_pdu *pdu = ravb_uring_pdu(ioucmd);
+	bool parked;
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	parked = !list_empty(&pdu->list);
+	if (parked)
+		list_del_init(&pdu->list);
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	/* otherwise its completion is already queued to the task */
+	if (parked)
+		io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+
+	return 0;
+}
+#endif
+
+static int ravb_streaming_uring_cmd(struct io_uring_cmd *ioucmd,
+				    unsigned int issue_flags)
+{
+	struct ravb_streaming_kernel_if *kif = ioucmd->file->private_data;
+	struct eavb_txparam txparam;
+	struct eavb_option option;
+	struct stqueue_info *stq;
+
+	if (!kif)
+		return -EPERM;
+
+	stq = kif->handle;
+
+#if KERNEL_VERSION(6, 7, 0) <= LINUX_VERSION_CODE
+	if (issue_flags & IO_URING_F_CANCEL)
+		return ravb_uring_cmd_cancel(stq, ioucmd, issue_flags);
+#endif
+
+	pr_debug("uring_cmd: %s cmd=%08x\n", stq_name(stq), ioucmd->cmd_op);
+
+	switch (ioucmd->cmd_op) {
+	case EAVB_ENTERRING:
+	case EAVB_WAITRING:
+		return ravb_uring_cmd_ring(stq, ioucmd, issue_flags);
+	case EAVB_SETTXPARAM:
+		/**
+		 * struct eavb_txparam does not fit the 16 byte command area
+		 * of a 64 byte SQE, only rings set up with
+		 * IORING_SETUP_SQE128 can carry it
+		 */
+		if (!(issue_flags & IO_URING_F_SQE128))
+			return -EINVAL;
+		/* may wait for the stream queue to become idle */
+		if (issue_flags & IO_URING_F_NONBLOCK)
+			return -EAGAIN;
+		memcpy(&txparam, ravb_uring_cmd_payload(ioucmd),
+		       sizeof(txparam));
+		return ravb_set_txparam_kernel(stq, &txparam);
+	case EAVB_SETOPTION:
+		/* fits the command area of any SQE */
+		BUILD_BUG_ON(sizeof(option) > 16);
+		memcpy(&option, ravb_uring_cmd_payload(ioucmd),
+		       sizeof(option));
+		return ravb_set_option_kernel(stq, &option);
+	default:
+		pr_err("incorrect %s call, cmd %u\n", __func__,
+		       ioucmd->cmd_op);
+		return -ENOTTY;
+	}
+}
+#else
+/* Caller must hold hwq->sem */
+static void stq_uring_complete(struct stqueue_info *stq, long result)
+{
+}
+#endif
+
+static long ravb_setup_ring(struct file *file, unsigned long parm)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+	struct hwqueue_info *hwq = stq->hwq;
+	struct eavb_ringparam param;
+	char __user *buf = (char __user *)parm;
+	long ret;
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	ret = stq_ring_setup(stq, &param);
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+	if (ret) {
+		pr_err("%s failure: %s err=%ld\n", __func__, stq_name(stq), ret);
+		return ret;
+	}
+
+	pr_debug("setup_ring: %s entries=%u sq=%u cq=%u size=%u\n",
+		 stq_name(stq), param.entries, param.sq_off,
+		 param.cq_off, param.mmap_size);
+
+	if (copy_to_user(buf, &param, sizeof(param)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long ravb_enter_ring(struct file *file)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+	struct hwqueue_info *hwq = stq->hwq;
+	int completed;
+
+	if (!stq->ring)
+		return -EINVAL;
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	completed = stq_ring_service(stq);
+	if (completed)
+		stq_uring_complete(stq, stq_ring_cq_count(stq));
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	if (completed)
+		avb_wake_up_interruptible(&stq->waitEvent,
+					  hwq->index, stq->qno);
+
+	return 0;
+}
+
+static int __ravb_streaming_read_stq_kernel(void *handle,
+					    void *buf,
+					    unsigned int num,
+					    enum eavb_entryformat format)
+{
+	struct stqueue_info *stq = handle;
+	struct hwqueue_info *hwq;
+	int i;
+	int err;
+
+	if (!stq)
+		return -EINVAL;
+
+	/* buf is not touched when acknowledged by count */
+	if (count_only(stq))
+		buf = NULL;
+	else if (!buf)
+		return -EINVAL;
+
+	pr_debug("read: %s > num=%d\n", stq_name(stq), num);
+
+	if (!num)
+		return 0;
+
+	if (stq->blockmode == EAVB_BLOCK_WAITALL &&
+	    num > RAVB_ENTRY_THRETH)
+		return -ENOMEM;
+
+	hwq = stq->hwq;
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	stq->cancel = false;
+	if (!is_readable_count(stq, num)) {
+		avb_up(&hwq->sem, hwq->index, stq->qno);
+
+		if (stq->flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		err = avb_wait_event_interruptible(
+			stq->waitEvent,
+			is_readable_count(stq, num) || stq->cancel,
+			hwq->index, stq->qno);
+		if (err < 0) {
+			pr_err("%s: failed to wait, err=%d\n", __func__, err);
+			return -EINTR;
+		}
+
+		avb_down(&hwq->sem, hwq->index, stq->qno);
+	}
+
+	i = stq_reap_entries(stq, buf, num, format);
+
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+	avb_wake_up_interruptible(&stq->waitEvent, hwq->index, stq->qno);
+
+	pr_debug("read: %s < num=%d\n", stq_name(stq), i);
+
+	return i;
+}
+
+static int ravb_streaming_read_stq_kernel(void *handle,
+					  struct eavb_entry *buf,
+					  unsigned int num)
+{
+	return __ravb_streaming_read_stq_kernel(handle, buf, num,
+						EAVB_ENTRYFORMAT_DEFAULT);
+}
+
+static int ravb_streaming_read_sg_stq_kernel(void *handle,
+					     struct eavb_entry_sg *buf,
+					     unsigned int num)
+{
+	return __ravb_streaming_read_stq_kernel(handle, buf, num,
+						EAVB_ENTRYFORMAT_SG);
+}
+
+static ssize_t ravb_streaming_read_stq(struct file *file,
+				       char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+	enum eavb_entryformat format = stq->entryformat;
+	size_t size = eavb_entry_size(format);
+	int num;
+	unsigned int fraction;
+	unsigned long ret;
+	ssize_t rsize;
+
+	if (stq->ring)
+		return -EBUSY;
+
+	stq->flags = file->f_flags;
+	num = count / size;
+	fraction = count % size;
+
+	pr_debug("read: %s < count=%zd, fraction=%d\n",
+		 stq_name(stq), count, fraction);
+
+	if (fraction) {
+		pr_err("incorrect data size: %u\n", fraction);
+		return -EINVAL;
+	}
+
+	/* larger entry formats fit fewer entries in ebuf */
+	if (!count_only(stq) && num > stq_ebuf_num(stq, format)) {
+		if (stq->blockmode == EAVB_BLOCK_WAITALL)
+			return -EINVAL;
+		num = stq_ebuf_num(stq, format);
+	}
+
+	num = __ravb_streaming_read_stq_kernel(stq, stq->ebuf, num, format);
+	if (num <= 0)
+		return (ssize_t)num;
+
+	if (!count_only(stq)) {
+		ret = copy_to_user(buf, stq->ebuf, num * size);
+		if (ret) {
+			pr_err("read: %s copy to user failed\n",
+			       stq_name(stq));
+			return -EFAULT;
+		}
+	}
+
+	rsize = num * size;
+	pr_debug("read: %s < count=%zd\n", stq_name(stq), rsize);
+
+	return rsize;
+}
+
+static ssize_t ravb_streaming_read(struct file *file,
+				   char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	if (!file->private_data)
+		return -EPERM;
+
+	return ravb_streaming_read_stq(file, buf, count, ppos);
+}
+
+static int __ravb_streaming_write_stq_kernel(void *handle,
+					     void *buf,
+					     unsigned int num,
+					     enum eavb_entryformat format)
+{
+	struct stqueue_info *stq = handle;
+	struct hwqueue_info *hwq;
+	struct list_head entry_queue;
+	struct ravb_cachesync sync;
+	unsigned int queued = 0;
+	int i;
+	int err;
+
+	if (!stq)
+		return -EINVAL;
+
+	if (!buf)
+		return -EINVAL;
+
+	pr_debug("write: %s > num=%d\n", stq_name(stq), num);
+
+	if (!num)
+		return 0;
+
+	hwq = stq->hwq;
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	stq->cancel = false;
+	if (!is_writeble(stq)) {
+		avb_up(&hwq->sem, hwq->index, stq->qno);
+
+		if (stq->flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		err = avb_wait_event_interruptible(
+			stq->waitEvent,
+			is_writeble(stq) || stq->cancel,
+			hwq->index, stq->qno);
+		if (err < 0) {
+			pr_err("%s: failed to wait, err=%d\n", __func__, err);
+			return -EINTR;
+		}
+
+		avb_down(&hwq->sem, hwq->index, stq->qno);
+	}
+
+	num = min_t(u32, (u32)num,
+		    RAVB_ENTRY_THRETH - stq->entrynum.accepted);
+	if (num)
+		stq->preparing++;
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+	/* entry remain is full */
+	if (!num)
+		return 0;
+
+	INIT_LIST_HEAD(&entry_queue);
+	cachesync_init(&sync, hwq->tx);
+	i = stq_prepare_entries(stq, buf, num, format, &entry_queue, &queued,
+				&sync);
+
+	avb_down(&hwq->sem, hwq->index, stq->qno);
+	stq_attach_entries(stq, &entry_queue, queued);
+	stq->preparing--;
+	cachesync_account(stq, &sync);
+	avb_up(&hwq->sem, hwq->index, stq->qno);
+
+	pr_debug("write: %s < num=%d\n", stq_name(stq), i);
+
+	return i;
+}
+
+static int ravb_streaming_write_stq_kernel(void *handle,
+					   struct eavb_entry *buf,
+					   unsigned int num)
+{
+	return __ravb_streaming_write_stq_kernel(handle, buf, num,
+						 EAVB_ENTRYFORMAT_DEFAULT);
+}
+
+static int ravb_streaming_write_sg_stq_kernel(void *handle,
+					      struct eavb_entry_sg *buf,
+					      unsigned int num)
+{
+	return __ravb_streaming_write_stq_kernel(handle, buf, num,
+						 EAVB_ENTRYFORMAT_SG);
+}
+
+static ssize_t ravb_streaming_write_stq(struct file *file,
+					const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+	enum eavb_entryformat format = stq->entryformat;
+	size_t size = eavb_entry_size(format);
+	int num;
+	unsigned int fraction;
+	unsigned long ret;
+	ssize_t wsize;
+
+	if (stq->ring)
+		return -EBUSY;
+
+	stq->flags = file->f_flags;
+	num = min_t(u32, (u32)(count / size), stq_ebuf_num(stq, format));
+	fraction = count % size;
+
+	pr_debug("write: %s < count=%zd, fraction=%d\n",
+		 stq_name(stq), count, fraction);
+
+	if (fraction) {
+		pr_err("incorrect data size: %u\n", fraction);
+		return -EINVAL;
+	}
+
+	ret = copy_from_user(stq->ebuf, buf, num * size);
+	if (ret) {
+		pr_err("write: %s copy from user failed\n", stq_name(stq));
+		return -EFAULT;
+	}
+
+	num = __ravb_streaming_write_stq_kernel(stq, stq->ebuf, num, format);
+	if (num <= 0)
+		return (ssize_t)num;
+
+	wsize = num * size;
+	pr_debug("write: %s < count=%zd\n", stq_name(stq), wsize);
+
+	return wsize;
+}
+
+static ssize_t ravb_streaming_write(struct file *file,
+				    const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	if (!file->private_data)
+		return -EPERM;
+
+	return ravb_streaming_write_stq(file, buf, count, ppos);
+}
+
+static unsigned int ravb_streaming_poll_stq(struct file *file,
+					    struct poll_table_struct *wait)
+{
+	int ret = 0;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+
+	pr_debug("poll: %s r=%d, w=%d\n",
+		 stq_name(stq), is_readable(stq), is_writeble(stq));
+
+	poll_wait(file, &stq->waitEvent, wait);
+
+	if (stq->ring) {
+		if (stq_ring_readable(stq))
+			ret |= POLLIN | POLLRDNORM;
+		if (READ_ONCE(stq->ring->sq.tail) - stq->sq_head <
+		    RAVB_ENTRY_THRETH)
+			ret |= POLLOUT | POLLWRNORM;
+
+		return ret;
+	}
+
+	if (is_readable(stq))
+		ret |= POLLIN | POLLRDNORM;
+
+	if (is_writeble(stq))
+		ret |= POLLOUT | POLLWRNORM;
+
+	return ret;
+}
+
+static unsigned int ravb_streaming_poll(struct file *file,
+					struct poll_table_struct *wait)
+{
+	if (!file->private_data)
+		return 0;
+
+	return ravb_streaming_poll_stq(file, wait);
+}
+
+static void ravb_streaming_vm_open(struct vm_area_struct *vma)
+{
+}
+
+static void ravb_streaming_vm_close(struct vm_area_struct *vma)
+{
+}
+
+#if KERNEL_VERSION(4, 10, 0) <= LINUX_VERSION_CODE
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+static vm_fault_t ravb_streaming_vm_fault(struct vm_fault *vmf)
 #else
 static int ravb_streaming_vm_fault(struct vm_fault *vmf)
 #endif
 #else
-static int ravb_streaming_vm_fault(struct vm_area_struct *area,
-				   struct vm_fault *vmf)
+static int ravb_streaming_vm_fault(struct vm_area_struct *area,
+				   struct vm_fault *vmf)
+#endif
+{
+	return VM_FAULT_SIGBUS;
+}
+
+static const struct vm_operations_struct ravb_streaming_mmap_ops = {
+	.open   = ravb_streaming_vm_open,
+	.close  = ravb_streaming_vm_close,
+	.fault  = ravb_streaming_vm_fault
+};
+
+static int ravb_streaming_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq;
+	struct ravb_user_page *userpage;
+	unsigned long size  = vma->vm_end - vma->vm_start;
+	dma_addr_t pgoff = (dma_addr_t)vma->vm_pgoff;
+	dma_addr_t physaddr = pgoff << PAGE_SHIFT;
+	unsigned long pfn;
+
+	if (kif)
+		stq = kif->handle;
+	else
+		stq = NULL;
+
+	pr_debug("mmap: %s range=%08lx-%08lx,size=%lu,physaddr=%pad\n",
+		 (stq) ? stq_name(stq) : stp_name(stp),
+		 vma->vm_start, vma->vm_end, size, &physaddr);
+
+	if (stq && stq->ring && physaddr == EAVB_RING_MMAP_OFFSET)
+		return remap_vmalloc_range(vma, stq->ring, 0);
+
+	userpage = lookup_userpage(stq, physaddr);
+	/* a mapping starts at the region and stays inside it */
+	if (!userpage || userpage->region.dma != physaddr ||
+	    size > userpage->region.size)
+		return -EINVAL;
+
+	/* behind the IPMMU a pool address is an IOVA, not a PFN */
+	if (userpage->chunk_map)
+		pfn = page_to_pfn(userpage->page);
+	else
+		pfn = pgoff;
+
+	vma->vm_page_prot = phys_mem_access_prot(file,
+						 pfn,
+						 size,
+						 vma->vm_page_prot);
+
+	vma->vm_ops = &ravb_streaming_mmap_ops;
+
+	if (remap_pfn_range(vma,
+			    vma->vm_start,
+			    pfn,
+			    size,
+			    vma->vm_page_prot))
+		return -EAGAIN;
+
+	return 0;
+}
+
+static long ravb_streaming_ioctl_stp(struct file *file,
+				     unsigned int cmd,
+				     unsigned long parm)
+{
+	struct streaming_private *stp = stp_ptr;
+
+	pr_debug("ioctl: %s cmd=%08x\n", stp_name(stp), cmd);
+
+	switch (cmd) {
+	case EAVB_MAPPAGE:
+		return ravb_map_page(file, parm);
+	case EAVB_UNMAPPAGE:
+		return ravb_unmap_page(file, parm);
+	case EAVB_MAPPOOL:
+		return ravb_map_pool(file, parm);
+	case EAVB_UNMAPPOOL:
+		return ravb_unmap_pool(file, parm);
+	case EAVB_POOLALLOC:
+		return ravb_pool_alloc(file, parm);
+	case EAVB_POOLFREE:
+		return ravb_pool_free(file, parm);
+	case EAVB_EXPORTDMABUF:
+		return ravb_export_dmabuf(file, parm);
+	case EAVB_GETCBSINFO:
+		return ravb_get_cbs_info(file, parm);
+	case EAVB_GDRVINFO:
+	case EAVB_GCOALESCE:
+	case EAVB_SCOALESCE:
+	case EAVB_GRINGPARAM:
+	case EAVB_SRINGPARAM:
+	case EAVB_GCHANNELS:
+	case EAVB_GSSET_INFO:
+	case EAVB_GSTRINGS:
+	case EAVB_GSTATS:
+		return ravb_streaming_ioctl_avbtool(file, cmd, parm);
+	default:
+		pr_err("incorrect %s call, cmd %u\n", __func__, cmd);
+		return -EINVAL;
+	}
+}
+
+static long ravb_streaming_ioctl_stq(struct file *file,
+				     unsigned int cmd,
+				     unsigned long parm)
+{
+	struct ravb_streaming_kernel_if *kif = file->private_data;
+	struct stqueue_info *stq = kif->handle;
+
+	pr_debug("ioctl: %s cmd=%08x\n", stq_name(stq), cmd);
+
+	switch (cmd) {
+	case EAVB_MAPPAGE:
+		return ravb_map_page(file, parm);
+	case EAVB_UNMAPPAGE:
+		return ravb_unmap_page(file, parm);
+	case EAVB_MAPPOOL:
+		return ravb_map_pool(file, parm);
+	case EAVB_UNMAPPOOL:
+		return ravb_unmap_pool(file, parm);
+	case EAVB_POOLALLOC:
+		return ravb_pool_alloc(file, parm);
+	case EAVB_POOLFREE:
+		return ravb_pool_free(file, parm);
+	case EAVB_EXPORTDMABUF:
+		return ravb_export_dmabuf(file, parm);
+	case EAVB_SETTXPARAM:
+		return ravb_set_txparam(file, parm);
+	case EAVB_GETTXPARAM:
+		return ravb_get_txparam(file, parm);
+	case EAVB_SETRXPARAM:
+		return ravb_set_rxparam(file, parm);
+	case EAVB_GETRXPARAM:
+		return ravb_get_rxparam(file, parm);
+	case EAVB_GETCBSINFO:
+		return ravb_get_cbs_info(file, parm);
+	case EAVB_SETOPTION:
+		return ravb_set_option(file, parm);
+	case EAVB_GETOPTION:
+		return ravb_get_option(file, parm);
+	case EAVB_SETUPRING:
+		return ravb_setup_ring(file, parm);
+	case EAVB_ENTERRING:
+		return ravb_enter_ring(file);
+	case EAVB_ATTACHDMABUF:
+		return ravb_attach_dmabuf(file, parm);
+	case EAVB_DETACHDMABUF:
+		return ravb_detach_dmabuf(file, parm);
+	case EAVB_SETTEMPLATE:
+		return ravb_set_template(file, parm);
+	case EAVB_GETTEMPLATE:
+		return ravb_get_template(file, parm);
+	case EAVB_SETGCL:
+		return ravb_set_gcl(file, parm);
+	case EAVB_GETGCL:
+		return ravb_get_gcl(file, parm);
+	case EAVB_GDRVINFO:
+	case EAVB_GCOALESCE:
+	case EAVB_SCOALESCE:
+	case EAVB_GRINGPARAM:
+	case EAVB_SRINGPARAM:
+	case EAVB_GCHANNELS:
+	case EAVB_GSSET_INFO:
+	case EAVB_GSTRINGS:
+	case EAVB_GSTATS:
+		return ravb_streaming_ioctl_avbtool(file, cmd, parm);
+	default:
+		pr_err("incorrect %s call, cmd %u\n", __func__, cmd);
+		return -EINVAL;
+	}
+}
+
+static long ravb_streaming_ioctl(struct file *file,
+				 unsigned int cmd, unsigned long parm)
+{
+	if (!file->private_data)
+		return ravb_streaming_ioctl_stp(file, cmd, parm);
+	else
+		return ravb_streaming_ioctl_stq(file, cmd, parm);
+}
+
+#ifdef CONFIG_COMPAT
+struct eavb_dma_alloc_compat {
+	u32 dma_paddr;
+	compat_uptr_t dma_vaddr;
+	compat_uint_t mmap_size;
+};
+
+#define EAVB_MAPPAGE_COMPAT   _IOR(EAVB_MAGIC, 1, struct eavb_dma_alloc_compat)
+#define EAVB_UNMAPPAGE_COMPAT _IOW(EAVB_MAGIC, 2, struct eavb_dma_alloc_compat)
+
+static long ravb_map_page_compat(struct file *file, unsigned long parm)
+{
+	long ret;
+	struct eavb_dma_alloc_compat dma32;
+	struct eavb_dma_alloc __user *pdma;
+	void __user *dma_vaddr;
+
+	pdma = compat_alloc_user_space(sizeof(*pdma));
+
+	ret = ravb_map_page(file, (unsigned long)(pdma));
+	if (ret)
+		return ret;
+
+	if (!access_ok(pdma, sizeof(*pdma)))
+		goto failed;
+	if (__get_user(dma32.dma_paddr, &pdma->dma_paddr) ||
+	    __get_user(dma_vaddr, &pdma->dma_vaddr) ||
+	    __get_user(dma32.mmap_size, &pdma->mmap_size))
+		goto failed;
+	dma32.dma_vaddr = ptr_to_compat(dma_vaddr);
+
+	if (copy_to_user((void __user *)parm, &dma32, sizeof(dma32)))
+		goto failed;
+
+	return 0;
+
+failed:
+	ravb_unmap_page(file, (unsigned long)(pdma));
+	pr_err("%s failed\n", __func__);
+
+	return -EFAULT;
+}
+
+static long ravb_unmap_page_compat(struct file *file, unsigned long parm)
+{
+	struct eavb_dma_alloc_compat dma32;
+	struct eavb_dma_alloc __user *pdma;
+
+	if (copy_from_user(&dma32, (void __user *)parm, sizeof(dma32)))
+		return -EFAULT;
+
+	pdma = compat_alloc_user_space(sizeof(*pdma));
+	if (!access_ok(pdma, sizeof(*pdma)))
+		return -EFAULT;
+	if (__put_user(dma32.dma_paddr, &pdma->dma_paddr) ||
+	    __put_user((void __user *)(unsigned long)dma32.dma_vaddr,
+		       &pdma->dma_vaddr) ||
+	    __put_user(dma32.mmap_size, &pdma->mmap_size))
+		return -EFAULT;
+
+	return ravb_unmap_page(file, (unsigned long)(pdma));
+}
+
+static long ravb_streaming_ioctl_compat(struct file *file,
+					unsigned int cmd, unsigned long parm)
+{
+	switch (cmd) {
+	case EAVB_MAPPAGE_COMPAT:
+		return ravb_map_page_compat(file, parm);
+	case EAVB_UNMAPPAGE_COMPAT:
+		return ravb_unmap_page_compat(file, parm);
+	default:
+		return ravb_streaming_ioctl(file, cmd, parm);
+	}
+}
+#endif
+
+static const struct file_operations ravb_streaming_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ravb_streaming_open,
+	.release	= ravb_streaming_release,
+	.read		= ravb_streaming_read,
+	.write		= ravb_streaming_write,
+	.poll		= ravb_streaming_poll,
+	.mmap       = ravb_streaming_mmap,
+	.unlocked_ioctl	= ravb_streaming_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= ravb_streaming_ioctl_compat,
+#endif
+#if KERNEL_VERSION(5, 19, 0) <= LINUX_VERSION_CODE
+	.uring_cmd	= ravb_streaming_uring_cmd,
+#endif
+};
+
+static inline int ravb_control_interrupt(struct net_device *ndev,
+					 struct hwqueue_info *hwq,
+					 bool enable)
+{
+	struct ravb_private *priv = netdev_priv(ndev);
+	u32 ofs, val;
+	unsigned long flags;
+
+	avb_spin_lock_irqsave(&priv->lock, flags, hwq->index, -1);
+	ofs = (hwq->tx) ? TIC : RIC0;
+	val = ravb_read(ndev, ofs);
+	if (enable)
+		ravb_write(ndev, (val | (1 << hwq->chno)), ofs);
+	else
+		ravb_write(ndev, (val & ~(1 << hwq->chno)), ofs);
+	avb_spin_unlock_irqrestore(&priv->lock, flags, hwq->index, -1);
+
+	return 0;
+}
+
+static inline int ravb_enable_interrupt(struct net_device *ndev,
+					struct hwqueue_info *hwq)
+{
+	struct ravb_private *priv = netdev_priv(ndev);
+
+	if (priv->chip_id == RCAR_GEN3) {
+		if (hwq->tx)
+			ravb_write(ndev, BIT(hwq->chno + TDP_BIT_OFFSET), TIE);
+		else
+			ravb_write(ndev, BIT(hwq->chno + RDP_BIT_OFFSET), RIE3);
+
+		/* if irq timeout isn't zero, start irq timeout timer */
+		hwq_try_to_start_irq_timeout_timer(hwq);
+
+		return 0;
+	}
+
+	return ravb_control_interrupt(ndev, hwq, true);
+}
+
+static inline int ravb_disable_interrupt(struct net_device *ndev,
+					 struct hwqueue_info *hwq)
+{
+	struct ravb_private *priv = netdev_priv(ndev);
+
+	if (priv->chip_id == RCAR_GEN3) {
+		if (hwq->tx)
+			ravb_write(ndev, BIT(hwq->chno + TDP_BIT_OFFSET), TID);
+		else
+			ravb_write(ndev, BIT(hwq->chno + RDP_BIT_OFFSET), RID3);
+
+		return 0;
+	}
+
+	return ravb_control_interrupt(ndev, hwq, false);
+}
+
+static inline int ravb_reload_chain(struct net_device *ndev, int index)
+{
+	u32 loadmask = 1 << index;
+
+	/* if not OPERATION mode, doesn't need reload chain */
+	if ((ravb_read(ndev, CSR) & CSR_OPS) != CSR_OPS_OPERATION)
+		return 0;
+
+	ravb_write(ndev, loadmask, DLR);
+	while (ravb_read(ndev, DLR) & loadmask)
+		;
+
+	return 0;
+}
+
+/* Restart the hardware at the head of a cleared descriptor chain */
+static void hwq_reset_chain(struct hwqueue_info *hwq)
+{
+	struct streaming_private *stp = to_stp(hwq->device.parent);
+	struct net_device *ndev = to_net_dev(stp->device.parent);
+	struct ravb_private *priv = netdev_priv(ndev);
+	struct ravb_desc *desc;
+	int index;
+
+	/* write EOS for hw terminate */
+	index = hwq->qno;
+	desc = (struct ravb_desc *)&priv->desc_bat[index];
+	desc->die_dt = DT_EOS;
+	/* force reload chain */
+	ravb_reload_chain(ndev, index);
+	/* clear descriptor chain */
+	clear_desc(hwq);
+	/* write LINKFIX as restore chain */
+	desc->die_dt = DT_LINKFIX;
+	/* force reload chain */
+	ravb_reload_chain(ndev, index);
+}
+
+static int hwq_task_process_terminate(struct hwqueue_info *hwq)
+{
+	struct stqueue_info *stq, *stq1;
+	struct stream_entry *e, *e1;
+	struct stqueue_info *stq_pool[RAVB_STQUEUE_NUM] = { NULL };
+	int i;
+
+	if (unlikely(hwq->defunct)) {
+		hwq_reset_chain(hwq);
+
+		/* flush activeStreamQueue */
+		for (i = 0; i < RAVB_STQUEUE_PRIO_NUM; i++) {
+			list_for_each_entry_safe(stq, stq1,
+						 &hwq->activeStreamQueue[i],
+						 list) {
+				stq_pool[stq->qno] = stq;
+				list_del(&stq->list);
+			}
+		}
+		hwq->activePrioMap = 0;
+		/* flush completeWaitQueue */
+		list_for_each_entry_safe(e, e1, &hwq->completeWaitQueue, list) {
+			stq_pool[e->stq->qno] = e->stq;
+			put_streaming_entry(e);
+		}
+
+		/* raise stream queue */
+		for (i = 0; i < RAVB_STQUEUE_NUM; i++) {
+			stq = stq_pool[i];
+			if (stq) {
+				stq_sequencer(stq, AVB_STATE_IDLE);
+				avb_wake_up_interruptible(&stq->waitEvent,
+							  hwq->index,
+							  stq->qno);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * runtime reconfiguration
+ *
+ * A quiesced hwqueue hands no new entries to the hardware, as with all
+ * its gates closed, and is drained once completeWaitQueue is empty.
+ * hwq->sem is only taken briefly while waiting, so readers, writers and
+ * the task of a draining hwqueue are not held up. Resuming wakes the
+ * task for the entries held meanwhile.
+ */
+static void hwq_set_quiesced(struct hwqueue_info *hwq, bool quiesced)
+{
+	avb_down(&hwq->sem, hwq->index, -1);
+	hwq->quiesced = quiesced;
+	avb_up(&hwq->sem, hwq->index, -1);
+
+	if (!quiesced)
+		hwq_event(hwq, AVB_EVENT_GATE, hwq->chno);
+}
+
+/* Wait until timeout for a quiesced hwqueue to drain */
+static int hwq_wait_drained(struct hwqueue_info *hwq, unsigned long timeout)
+{
+	bool drained;
+
+	for (;;) {
+		avb_down(&hwq->sem, hwq->index, -1);
+		drained = list_empty(&hwq->completeWaitQueue);
+		avb_up(&hwq->sem, hwq->index, -1);
+		if (drained)
+			return 0;
+		if (time_after(jiffies, timeout))
+			return -EBUSY;
+		msleep(1);
+	}
+}
+
+/* Resize the chain of a drained hwqueue */
+static void hwq_resize_chain(struct hwqueue_info *hwq, u32 size)
+{
+	avb_down(&hwq->sem, hwq->index, -1);
+	/* the previous LINKFIX becomes a plain descriptor again */
+	hwq->ringsize = size - 1;
+	hwq_reset_chain(hwq);
+	hwq->minremain = hwq->remain;
+	/* a shorter ring bounds the frames per interrupt */
+	if (hwq->coalesce.frames > hwq_coalesce_frames_max(hwq))
+		hwq->coalesce.frames = hwq_coalesce_frames_max(hwq);
+	if (hwq->irq_coalesce_frame_count > hwq->coalesce.frames)
+		hwq->irq_coalesce_frame_count = hwq->coalesce.frames;
+	avb_up(&hwq->sem, hwq->index, -1);
+}
+
+/* size counts the LINKFIX descriptor closing the chain */
+int avb_set_ringsize(struct hwqueue_info *hwq, u32 size)
+{
+	unsigned long timeout;
+	int err;
+
+	if (size < RAVB_RINGSIZE_MIN || size > RAVB_RINGSIZE)
+		return -EINVAL;
+
+	/* the same size needs no drain */
+	if (READ_ONCE(hwq->ringsize) == size - 1)
+		return 0;
+
+	timeout = jiffies + msecs_to_jiffies(RAVB_QUIESCE_TIMEOUT_MSEC);
+
+	hwq_set_quiesced(hwq, true);
+	err = hwq_wait_drained(hwq, timeout);
+	if (!err)
+		hwq_resize_chain(hwq, size);
+	hwq_set_quiesced(hwq, false);
+
+	return err;
+}
+
+/**
+ * Resize the TX and RX hwqueues all or nothing. The hwqueues changing
+ * size drain together and are resized once all of them have drained.
+ */
+int avb_set_ringparam(struct streaming_private *stp, u32 tx_size,
+		      u32 rx_size)
+{
+	struct hwqueue_info *hwq;
+	DECLARE_BITMAP(resize_map, RAVB_HWQUEUE_NUM);
+	unsigned long timeout;
+	int i, err = 0;
+	u32 size;
+
+	if (tx_size < RAVB_RINGSIZE_MIN || tx_size > RAVB_RINGSIZE ||
+	    rx_size < RAVB_RINGSIZE_MIN || rx_size > RAVB_RINGSIZE)
+		return -EINVAL;
+
+	bitmap_zero(resize_map, RAVB_HWQUEUE_NUM);
+
+	for (i = 0; i < RAVB_HWQUEUE_NUM; i++) {
+		hwq = &stp->hwqueueInfoTable[i];
+		size = (hwq->tx) ? tx_size : rx_size;
+		if (READ_ONCE(hwq->ringsize) == size - 1)
+			continue;
+
+		hwq_set_quiesced(hwq, true);
+		set_bit(i, resize_map);
+	}
+
+	/* one deadline for all of them */
+	timeout = jiffies + msecs_to_jiffies(RAVB_QUIESCE_TIMEOUT_MSEC);
+	for_each_set_bit(i, resize_map, RAVB_HWQUEUE_NUM) {
+		hwq = &stp->hwqueueInfoTable[i];
+		err = hwq_wait_drained(hwq, timeout);
+		if (err) {
+			pr_err("set_ringparam: %s failure, err=%d\n",
+			       hwq_name(hwq), err);
+			break;
+		}
+	}
+
+	/* all of them resume, resized only if all have drained */
+	for_each_set_bit(i, resize_map, RAVB_HWQUEUE_NUM) {
+		hwq = &stp->hwqueueInfoTable[i];
+		if (!err)
+			hwq_resize_chain(hwq, (hwq->tx) ? tx_size : rx_size);
+		hwq_set_quiesced(hwq, false);
+	}
+
+	return err;
+}
+
+void avb_get_coalesce(struct hwqueue_info *hwq,
+		      struct eavb_avbtool_coalesce *coalesce)
+{
+	struct coalesce_info *c = &hwq->coalesce;
+
+	avb_down(&hwq->sem, hwq->index, -1);
+	coalesce->coalesce_usecs = c->usec;
+	coalesce->max_coalesced_frames = c->frames + 1;
+	coalesce->use_adaptive_coalesce = c->adaptive;
+	avb_up(&hwq->sem, hwq->index, -1);
+}
+
+int avb_set_coalesce(struct hwqueue_info *hwq,
+		     const struct eavb_avbtool_coalesce *coalesce)
+{
+	struct coalesce_info *c = &hwq->coalesce;
+
+	if (coalesce->coalesce_usecs > USEC_PER_SEC)
+		return -EINVAL;
+
+	avb_down(&hwq->sem, hwq->index, -1);
+	if (coalesce->max_coalesced_frames > hwq_coalesce_frames_max(hwq) + 1) {
+		avb_up(&hwq->sem, hwq->index, -1);
+		return -EINVAL;
+	}
+	WRITE_ONCE(c->adaptive, !!coalesce->use_adaptive_coalesce);
+	if (!c->adaptive) {
+		/* 0 frames, as 1, is an interrupt per frame */
+		c->frames = coalesce->max_coalesced_frames ?
+			coalesce->max_coalesced_frames - 1 : 0;
+		WRITE_ONCE(c->usec, coalesce->coalesce_usecs);
+		if (hwq->irq_coalesce_frame_count > c->frames)
+			hwq->irq_coalesce_frame_count = c->frames;
+		/* only later parameter writes override these */
+		hwq_coalesce_params(hwq, &c->param_frames, &c->param_usec);
+	}
+	avb_up(&hwq->sem, hwq->index, -1);
+
+	return 0;
+}
+
+/**
+ * placement
+ *
+ * The task and the interrupt of a hwqueue share its CPUs so that its
+ * hwqueue_info stays in one cache. An IRQ thread follows the affinity
+ * of its interrupt.
+ */
+static int hwq_irq_set_affinity(struct hwqueue_info *hwq,
+				const struct cpumask *cpus)
+{
+	if (!hwq->irq)
+		return 0;
+
+#if KERNEL_VERSION(5, 13, 0) <= LINUX_VERSION_CODE
+	return irq_set_affinity(hwq->irq, cpus);
+#else
+	return irq_set_affinity_hint(hwq->irq, cpus);
+#endif
+}
+
+static void hwq_irq_clear_affinity(struct hwqueue_info *hwq)
+{
+#if KERNEL_VERSION(5, 13, 0) > LINUX_VERSION_CODE
+	/* free_irq complains about a hint left behind */
+	if (hwq->irq)
+		irq_set_affinity_hint(hwq->irq, NULL);
+#endif
+}
+
+int avb_set_cpus(struct hwqueue_info *hwq, const struct cpumask *cpus)
+{
+	cpumask_var_t old;
+	int err;
+
+	if (!hwq->task)
+		return -ENODEV;
+	if (!cpumask_intersects(cpus, cpu_online_mask))
+		return -EINVAL;
+	if (!alloc_cpumask_var(&old, GFP_KERNEL))
+		return -ENOMEM;
+
+	avb_down(&hwq->sem, hwq->index, -1);
+	err = set_cpus_allowed_ptr(hwq->task, cpus);
+	if (!err) {
+		cpumask_copy(old, &hwq->cpus);
+		/* the affinity hint keeps pointing at hwq->cpus */
+		cpumask_copy(&hwq->cpus, cpus);
+		err = hwq_irq_set_affinity(hwq, &hwq->cpus);
+		if (err) {
+			/* task and interrupt stay together on the old CPUs */
+			cpumask_copy(&hwq->cpus, old);
+			set_cpus_allowed_ptr(hwq->task, &hwq->cpus);
+		}
+	}
+	avb_up(&hwq->sem, hwq->index, -1);
+
+	free_cpumask_var(old);
+
+	return err;
+}
+
+int avb_set_rt_prio(struct hwqueue_info *hwq, int prio)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = prio ? SCHED_FIFO : SCHED_NORMAL,
+		.sched_priority = prio,
+	};
+	int err;
+
+	if (!hwq->task)
+		return -ENODEV;
+	if (prio < 0 || prio > MAX_RT_PRIO - 1)
+		return -EINVAL;
+
+	avb_down(&hwq->sem, hwq->index, -1);
+	err = sched_setattr_nocheck(hwq->task, &attr);
+	if (!err)
+		hwq->rt_prio = prio;
+	avb_up(&hwq->sem, hwq->index, -1);
+
+	return err;
+}
+
+/**
+ * deficit round robin across stream queues
+ *
+ * The highest priority level with active stream queues is served first.
+ * Within a level, each round, a stream queue reaching the head of the list is
+ * credited a quantum of bytes in proportion to its reserved bandwidth
+ * and sends entries while its deficit covers them. A stream of large
+ * frames thereby cannot take the ring slots of a stream of small
+ * frames beyond its reserved share.
+ */
+static inline u32 stq_drr_quantum(struct stqueue_info *stq)
+{
+	u32 quantum;
+
+	quantum = ((u64)stq->cbs.bandwidthFraction * RAVB_DRR_QUANTUM_FULL) >> 32;
+
+	return max_t(u32, quantum, RAVB_DRR_QUANTUM_MIN);
+}
+
+static u32 entry_bytes(struct stream_entry *e)
+{
+	u32 bytes = 0;
+	int i;
+
+	for (i = 0; i < e->vecsize; i++)
+		bytes += e->msg.vec[i].len;
+
+	return bytes;
+}
+
+/**
+ * launch time gating
+ *
+ * A stream queue whose head entry is not due yet is set aside for the
+ * pass, and launch_timer wakes the hwq task at the earliest release time.
+ */
+/* Returns the CLOCK_TAI time to release e at, 0 if e is not gated */
+static u64 entry_release_time(struct stqueue_info *stq,
+			      struct stream_entry *e)
+{
+	u64 lead = (u64)max(launch_lead_usec, 0) * NSEC_PER_USEC;
+
+	if (!e->launch_time || stq->detaching || e->launch_time <= lead)
+		return 0;
+
+	return e->launch_time - lead;
+}
+
+static enum hrtimer_restart ravb_streaming_launch_handler(struct hrtimer *timer)
+{
+	struct hwqueue_info *hwq;
+
+	hwq = container_of(timer, struct hwqueue_info, launch_timer);
+	hwq_event(hwq, AVB_EVENT_LAUNCH, hwq->chno);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * per stream shaping
+ *
+ * Hardware CBS shapes a whole class. When enabled, a stream queue is
+ * additionally held to its own reservation: a frame conforms once the
+ * stream's bucket, refilled at bandwidthFraction of the link rate up to
+ * its hiCredit burst, covers it. A nonconforming stream queue is held
+ * back like one whose entry is not due yet.
+ */
+/* Returns the time to send bytes at the reserved rate of stq, in ns */
+static u64 shaper_cost(struct stqueue_info *stq, u32 bytes)
+{
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_private *priv = netdev_priv(to_net_dev(stp->device.parent));
+	u64 rate = (u64)stq->cbs.bandwidthFraction * priv->speed;
+
+	/* bits * 1000 / Mbps, scaled by the 2^32 of bandwidthFraction */
+#if KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE
+	return mul_u64_u64_div_u64((u64)bytes * 8 * 1000, 1ULL << 32, rate);
+#else
+	/* exact below 512 KiB, far above any depth or entry */
+	return div64_u64(((u64)bytes * 8 * 1000) << 32, rate);
 #endif
+}
+
+static inline bool shaper_active(struct stqueue_info *stq)
 {
-	return VM_FAULT_SIGBUS;
+	struct streaming_private *stp = stp_ptr;
+	struct ravb_private *priv = netdev_priv(to_net_dev(stp->device.parent));
+
+	return stq->shaper.enabled && !stq->detaching &&
+		stq->cbs.bandwidthFraction && priv->speed > 0;
 }
 
-static const struct vm_operations_struct ravb_streaming_mmap_ops = {
-	.open   = ravb_streaming_vm_open,
-	.close  = ravb_streaming_vm_close,
-	.fault  = ravb_streaming_vm_fault
-};
+/* Returns the CLOCK_TAI time e conforms at, 0 if it conforms now */
+static u64 shaper_release_time(struct stqueue_info *stq,
+			       struct stream_entry *e, u64 now)
+{
+	struct token_bucket *tb = &stq->shaper;
+	u32 depth = RAVB_SHAPER_DEPTH_MIN;
+	u64 release;
 
-static int ravb_streaming_mmap(struct file *file, struct vm_area_struct *vma)
+	if (stq->cbs.idleSlope)
+		depth = clamp_t(u32, stq->cbs.hiCredit / stq->cbs.idleSlope / 8,
+				RAVB_SHAPER_DEPTH_MIN, RAVB_SHAPER_DEPTH_MAX);
+
+	release = tb->tat + shaper_cost(stq, entry_bytes(e) +
+					RAVB_SHAPER_FRAME_OVERHEAD);
+	release -= min(release, shaper_cost(stq, depth));
+
+	return (release > now) ? release : 0;
+}
+
+static void shaper_consume(struct stqueue_info *stq, u32 bytes, u64 now)
 {
-	struct streaming_private *stp = stp_ptr;
-	struct ravb_streaming_kernel_if *kif = file->private_data;
-	struct stqueue_info *stq;
-	unsigned long size  = vma->vm_end - vma->vm_start;
-	dma_addr_t pgoff = (dma_addr_t)vma->vm_pgoff;
-	dma_addr_t physaddr = pgoff << PAGE_SHIFT;
+	struct token_bucket *tb = &stq->shaper;
 
-	if (kif)
-		stq = kif->handle;
-	else
-		stq = NULL;
+	tb->tat = max(tb->tat, now) +
+		shaper_cost(stq, bytes + RAVB_SHAPER_FRAME_OVERHEAD);
+	tb->blocked = false;
+}
 
-	pr_debug("mmap: %s range=%08lx-%08lx,size=%lu,physaddr=%pad\n",
-		 (stq) ? stq_name(stq) : stp_name(stp),
-		 vma->vm_start, vma->vm_end, size, &physaddr);
+/**
+ * class interval pacing
+ *
+ * A paced stream queue sends one entry per class measurement interval
+ * of its hwqueue. Userspace may queue far ahead and the launch timer
+ * releases the entries, keeping the cadence of the slots as long as the
+ * stream queue does not run dry.
+ */
+static inline u64 pacing_interval(struct stqueue_info *stq)
+{
+	return (stq->hwq->index == EAVB_CLASSA) ?
+		RAVB_PACING_INTERVAL_CLASSA : RAVB_PACING_INTERVAL_CLASSB;
+}
 
-	if (!lookup_userpage(stq, physaddr))
-		return -EINVAL;
+/* Returns the CLOCK_TAI time of the next slot of stq, 0 if it is open */
+static u64 pacing_release_time(struct stqueue_info *stq, u64 now)
+{
+	if (!stq->pacing.enabled || stq->detaching || stq->pacing.next <= now)
+		return 0;
 
-	vma->vm_page_prot = phys_mem_access_prot(file,
-						 pgoff,
-						 size,
-						 vma->vm_page_prot);
+	return stq->pacing.next;
+}
 
-	vma->vm_ops = &ravb_streaming_mmap_ops;
+static void pacing_consume(struct stqueue_info *stq, u64 now)
+{
+	struct pacing_info *pacing = &stq->pacing;
+	u64 interval = pacing_interval(stq);
 
-	if (remap_pfn_range(vma,
-			    vma->vm_start,
-			    pgoff,
-			    size,
-			    vma->vm_page_prot))
-		return -EAGAIN;
+	/* a late slot keeps the cadence, a missed one restarts it */
+	if (pacing->next && now < pacing->next + interval)
+		pacing->next += interval;
+	else
+		pacing->next = now + interval;
+}
 
-	return 0;
+/**
+ * burst limits
+ *
+ * A pass stops once it has sent burst_entries or burst_bytes, and a
+ * stream queue is set aside for the rest of the pass once it has sent
+ * stq_burst_entries or stq_burst_bytes. The task then releases hwq->sem
+ * and runs the next pass at once, so that a newly attached stream queue
+ * waits for one burst instead of a whole ring. The frame reaching a byte
+ * limit is still sent.
+ */
+static inline bool burst_reached(u32 limit, u32 sent)
+{
+	return limit && sent >= limit;
 }
 
-static long ravb_streaming_ioctl_stp(struct file *file,
-				     unsigned int cmd,
-				     unsigned long parm)
+/**
+ * ring fill watermarks
+ *
+ * Once the ring is filled up to a high watermark, encoding stops until
+ * it drained down to the low one, so that a hwqueue can trade throughput
+ * for the latency of a shallow ring. Watermarks are set in descriptors
+ * and in usec of transmit time at the link speed, either or both. Frames
+ * close to the high watermark interrupt, so that the task wakes around
+ * the low one.
+ */
+static inline u32 usec_to_link_bytes(u32 usec)
 {
 	struct streaming_private *stp = stp_ptr;
+	struct ravb_private *priv = netdev_priv(to_net_dev(stp->device.parent));
 
-	pr_debug("ioctl: %s cmd=%08x\n", stp_name(stp), cmd);
+	return (u32)min_t(u64, (u64)usec * max(priv->speed, 0) / 8, U32_MAX);
+}
 
-	switch (cmd) {
-	case EAVB_MAPPAGE:
-		return ravb_map_page(file, parm);
-	case EAVB_UNMAPPAGE:
-		return ravb_unmap_page(file, parm);
-	case EAVB_GETCBSINFO:
-		return ravb_get_cbs_info(file, parm);
-	case EAVB_GDRVINFO:
-	case EAVB_GRINGPARAM:
-	case EAVB_GCHANNELS:
-	case EAVB_GSSET_INFO:
-	case EAVB_GSTRINGS:
-	case EAVB_GSTATS:
-		return ravb_streaming_ioctl_avbtool(file, cmd, parm);
-	default:
-		pr_err("incorrect %s call, cmd %u\n", __func__, cmd);
-		return -EINVAL;
+static inline u32 ring_used(struct hwqueue_info *hwq)
+{
+	return hwq->ringsize - hwq->remain;
+}
+
+static bool ring_above(struct hwqueue_info *hwq, u32 desc, u32 bytes)
+{
+	return (desc && ring_used(hwq) >= desc) ||
+		(bytes && hwq->inflight_bytes >= bytes);
+}
+
+/* state of one hwq_task_process_encode() pass */
+struct ravb_encode_pass {
+	struct list_head held;
+	struct list_head throttled;
+	u64 now;
+	u64 next_release;
+	u32 entries;
+	u32 bytes;
+	u32 burst_entries;
+	u32 burst_bytes;
+	u32 stq_burst_entries;
+	u32 stq_burst_bytes;
+	unsigned long open; /* priority levels open by the gate */
+	u32 high;
+	u32 low;
+	u32 high_bytes;
+	u32 low_bytes;
+	bool yield;
+	bool ring_full;
+	/* scheduler state */
+	union {
+		struct {
+			struct stqueue_info *heap[RAVB_STQUEUE_NUM];
+			int num;
+			bool built;
+		} edf;
+	};
+};
+
+static void ring_watermark_begin(struct hwqueue_info *hwq,
+				 struct ravb_encode_pass *ep)
+{
+	ep->high = READ_ONCE(hwq->ring_high);
+	ep->low = ep->high ? min(READ_ONCE(hwq->ring_low), ep->high) : 0;
+	ep->high_bytes = usec_to_link_bytes(READ_ONCE(hwq->ring_high_usec));
+	ep->low_bytes = ep->high_bytes ?
+		min(usec_to_link_bytes(READ_ONCE(hwq->ring_low_usec)),
+		    ep->high_bytes) : 0;
+
+	if (!hwq->draining)
+		return;
+
+	/* resume once at or below every low watermark in use */
+	if ((!ep->high || ring_used(hwq) <= ep->low) &&
+	    (!ep->high_bytes || hwq->inflight_bytes <= ep->low_bytes))
+		hwq->draining = false;
+}
+
+/* Returns true if a frame may be the last one sent before draining */
+static bool ring_near_high(struct hwqueue_info *hwq,
+			   struct ravb_encode_pass *ep,
+			   int vecsize, u32 bytes)
+{
+	return (ep->high &&
+		ring_used(hwq) + vecsize + ep->low >= ep->high) ||
+		(ep->high_bytes &&
+		 (u64)hwq->inflight_bytes + bytes + ep->low_bytes >=
+		 ep->high_bytes);
+}
+
+/* Levels of the stream queues being released, kept open for them */
+static u32 hwq_detaching_levels(struct hwqueue_info *hwq)
+{
+	struct stqueue_info *stq;
+	u32 levels = 0;
+	int qno;
+
+	for_each_set_bit(qno, hwq->stream_map, RAVB_STQUEUE_NUM) {
+		stq = hwq->stqueueInfoTable[qno];
+		if (stq->detaching)
+			levels |= BIT(stq->priority);
 	}
+
+	return levels;
 }
 
-static long ravb_streaming_ioctl_stq(struct file *file,
-				     unsigned int cmd,
-				     unsigned long parm)
+static void encode_pass_begin(struct hwqueue_info *hwq,
+			      struct ravb_encode_pass *ep)
 {
-	struct ravb_streaming_kernel_if *kif = file->private_data;
-	struct stqueue_info *stq = kif->handle;
+	memset(ep, 0, sizeof(*ep));
+	INIT_LIST_HEAD(&ep->held);
+	INIT_LIST_HEAD(&ep->throttled);
+	ep->burst_entries = READ_ONCE(hwq->burst_entries);
+	ep->burst_bytes = READ_ONCE(hwq->burst_bytes);
+	ep->stq_burst_entries = READ_ONCE(hwq->stq_burst_entries);
+	ep->stq_burst_bytes = READ_ONCE(hwq->stq_burst_bytes);
+	ep->open = hwq->quiesced ? 0 : READ_ONCE(hwq->gate.mask);
+	if (hwq->detaching && !hwq->quiesced)
+		ep->open |= hwq_detaching_levels(hwq);
+	hwq->pass++;
 
-	pr_debug("ioctl: %s cmd=%08x\n", stq_name(stq), cmd);
+	if (hwq->tx)
+		ring_watermark_begin(hwq, ep);
+}
 
-	switch (cmd) {
-	case EAVB_MAPPAGE:
-		return ravb_map_page(file, parm);
-	case EAVB_UNMAPPAGE:
-		return ravb_unmap_page(file, parm);
-	case EAVB_SETTXPARAM:
-		return ravb_set_txparam(file, parm);
-	case EAVB_GETTXPARAM:
-		return ravb_get_txparam(file, parm);
-	case EAVB_SETRXPARAM:
-		return ravb_set_rxparam(file, parm);
-	case EAVB_GETRXPARAM:
-		return ravb_get_rxparam(file, parm);
-	case EAVB_GETCBSINFO:
-		return ravb_get_cbs_info(file, parm);
-	case EAVB_SETOPTION:
-		return ravb_set_option(file, parm);
-	case EAVB_GETOPTION:
-		return ravb_get_option(file, parm);
-	case EAVB_GDRVINFO:
-	case EAVB_GRINGPARAM:
-	case EAVB_GCHANNELS:
-	case EAVB_GSSET_INFO:
-	case EAVB_GSTRINGS:
-	case EAVB_GSTATS:
-		return ravb_streaming_ioctl_avbtool(file, cmd, parm);
-	default:
-		pr_err("incorrect %s call, cmd %u\n", __func__, cmd);
-		return -EINVAL;
+/* CLOCK_TAI time read once per pass */
+static u64 encode_pass_now(struct ravb_encode_pass *ep)
+{
+	if (!ep->now)
+		ep->now = ktime_to_ns(ktime_get_clocktai());
+
+	return ep->now;
+}
+
+/* Set stq aside for the pass if its head entry e is not due yet */
+static bool encode_pass_hold(struct hwqueue_info *hwq,
+			     struct ravb_encode_pass *ep,
+			     struct stqueue_info *stq,
+			     struct stream_entry *e)
+{
+	u64 release = entry_release_time(stq, e);
+
+	if (!release || release <= encode_pass_now(ep))
+		release = pacing_release_time(stq, encode_pass_now(ep));
+
+	if (!release) {
+		if (!shaper_active(stq))
+			return false;
+
+		release = shaper_release_time(stq, e, encode_pass_now(ep));
+		if (!release)
+			return false;
+
+		/* counted once per entry however long it is held */
+		if (!stq->shaper.blocked) {
+			stq->shaper.blocked = true;
+			stq->dstats.nonconforming++;
+		}
 	}
+
+	if (!ep->next_release || release < ep->next_release)
+		ep->next_release = release;
+	hwq_deactivate_stq(hwq, stq);
+	list_add_tail(&stq->list, &ep->held);
+
+	return true;
 }
 
-static long ravb_streaming_ioctl(struct file *file,
-				 unsigned int cmd, unsigned long parm)
+static void encode_pass_stq(struct hwqueue_info *hwq,
+			    struct stqueue_info *stq)
 {
-	if (!file->private_data)
-		return ravb_streaming_ioctl_stp(file, cmd, parm);
+	struct schedule_info *sched = &stq->schedInfo;
+
+	if (sched->pass != hwq->pass) {
+		sched->pass = hwq->pass;
+		sched->burst_entries = 0;
+		sched->burst_bytes = 0;
+	}
+}
+
+/**
+ * Hand the head entry e of stq to the hardware. last tells that no other
+ * entry is pending on the hwqueue. Returns true if stq left the active
+ * stream queues, being idle or throttled for the rest of the pass.
+ */
+static bool encode_pass_entry(struct hwqueue_info *hwq,
+			      struct ravb_encode_pass *ep,
+			      struct stqueue_info *stq,
+			      struct stream_entry *e,
+			      u32 bytes, bool last)
+{
+	struct schedule_info *sched = &stq->schedInfo;
+	bool irq_enable;
+
+	/**
+	 * Interrupt on the last frame, and on every frame after
+	 * which the next one may no longer fit in the ring.
+	 */
+	irq_enable = last || hwq->remain < e->vecsize + EAVB_ENTRYVECNUM_MAX ||
+		ring_near_high(hwq, ep, e->vecsize, bytes);
+
+	if (e->launch_time && encode_pass_now(ep) > e->launch_time)
+		stq->dstats.deadline_misses++;
+
+	if (shaper_active(stq))
+		shaper_consume(stq, bytes, encode_pass_now(ep));
+
+	if (stq->pacing.enabled)
+		pacing_consume(stq, encode_pass_now(ep));
+
+	sched->burst_entries++;
+	sched->burst_bytes += bytes;
+	ep->entries++;
+	ep->bytes += bytes;
+	if (hwq->tx)
+		hwq->inflight_bytes += bytes;
+	desc_copy(hwq, e, irq_enable);
+	trace_avb_entry_encode(e);
+	list_move_tail(&e->list, &hwq->completeWaitQueue);
+	stq->entrynum.processed++;
+
+	if (hwq->tx)
+		stq->dstats.tx_entry_wait--;
 	else
-		return ravb_streaming_ioctl_stq(file, cmd, parm);
+		stq->dstats.rx_entry_wait--;
+
+	if (list_empty(&stq->entryWaitQueue)) {
+		hwq_deactivate_stq(hwq, stq);
+		stq_sequencer(stq, AVB_STATE_WAITCOMPLETE);
+		return true;
+	}
+
+	if (burst_reached(ep->stq_burst_entries, sched->burst_entries) ||
+	    burst_reached(ep->stq_burst_bytes, sched->burst_bytes)) {
+		hwq_deactivate_stq(hwq, stq);
+		list_add_tail(&stq->list, &ep->throttled);
+		return true;
+	}
+
+	return false;
 }
 
-#ifdef CONFIG_COMPAT
-struct eavb_dma_alloc_compat {
-	u32 dma_paddr;
-	compat_uptr_t dma_vaddr;
-	compat_uint_t mmap_size;
-};
+/* Returns true if the pass used up its burst limit */
+static bool encode_pass_done(struct ravb_encode_pass *ep)
+{
+	if (burst_reached(ep->burst_entries, ep->entries) ||
+	    burst_reached(ep->burst_bytes, ep->bytes))
+		ep->yield = true;
 
-#define EAVB_MAPPAGE_COMPAT   _IOR(EAVB_MAGIC, 1, struct eavb_dma_alloc_compat)
-#define EAVB_UNMAPPAGE_COMPAT _IOW(EAVB_MAGIC, 2, struct eavb_dma_alloc_compat)
+	return ep->yield;
+}
 
-static long ravb_map_page_compat(struct file *file, unsigned long parm)
+static void encode_pass_end(struct hwqueue_info *hwq,
+			    struct ravb_encode_pass *ep)
 {
-	long ret;
-	struct eavb_dma_alloc_compat dma32;
-	struct eavb_dma_alloc __user *pdma;
-	void __user *dma_vaddr;
+	struct stqueue_info *stq, *stq1;
 
-	pdma = compat_alloc_user_space(sizeof(*pdma));
+	/* throttled stream queues go last in their level */
+	if (!list_empty(&ep->throttled) && !ep->ring_full)
+		ep->yield = true;
+	list_for_each_entry_safe(stq, stq1, &ep->throttled, list) {
+		list_move_tail(&stq->list, &hwq->activeStreamQueue[stq->priority]);
+		__set_bit(stq->priority, &hwq->activePrioMap);
+	}
 
-	ret = ravb_map_page(file, (unsigned long)(pdma));
-	if (ret)
-		return ret;
+	/* held stream queues are served first in their level on the next pass */
+	list_for_each_entry_safe_reverse(stq, stq1, &ep->held, list) {
+		list_move(&stq->list, &hwq->activeStreamQueue[stq->priority]);
+		__set_bit(stq->priority, &hwq->activePrioMap);
+	}
+	hwq->yielded = ep->yield && (hwq->activePrioMap & ep->open);
+	/* closed levels wait for AVB_EVENT_GATE like held entries */
+	hwq->gated = ep->next_release || (hwq->activePrioMap & ~ep->open);
+	if (ep->next_release)
+		hrtimer_start(&hwq->launch_timer,
+			      ns_to_ktime(ep->next_release),
+			      HRTIMER_MODE_ABS);
+}
 
-	if (!access_ok(pdma, sizeof(*pdma)))
-		goto failed;
-	if (__get_user(dma32.dma_paddr, &pdma->dma_paddr) ||
-	    __get_user(dma_vaddr, &pdma->dma_vaddr) ||
-	    __get_user(dma32.mmap_size, &pdma->mmap_size))
-		goto failed;
-	dma32.dma_vaddr = ptr_to_compat(dma_vaddr);
+/* Count the open stream queues below prio left waiting on a full ring */
+static void hwq_account_starved(struct hwqueue_info *hwq,
+				unsigned long open, int prio)
+{
+	struct stqueue_info *stq;
+	unsigned long map = hwq->activePrioMap & open;
+	int i;
 
-	if (copy_to_user((void __user *)parm, &dma32, sizeof(dma32)))
-		goto failed;
+	for_each_set_bit(i, &map, prio) {
+		list_for_each_entry(stq, &hwq->activeStreamQueue[i], list)
+			stq->dstats.starved++;
+	}
+}
 
-	return 0;
+/**
+ * schedulers
+ *
+ * A scheduler picks the stream queue whose head entry goes next among
+ * the active stream queues of the open priority levels. attach and
+ * detach bracket the time a stream queue is open on the hwqueue under
+ * the scheduler, including scheduler switches. enqueue is told when a
+ * stream queue becomes active, sent before its head entry is handed to
+ * the hardware, and remove when it leaves the active stream queues in
+ * the middle of a pass.
+ */
+/* round robin, one entry per stream queue in turn within a level */
+static struct stqueue_info *rr_dequeue(struct hwqueue_info *hwq,
+				       struct ravb_encode_pass *ep)
+{
+	unsigned long map = hwq->activePrioMap & ep->open;
 
-failed:
-	ravb_unmap_page(file, (unsigned long)(pdma));
-	pr_err("%s failed\n", __func__);
+	if (!map)
+		return NULL;
 
-	return -EFAULT;
+	return list_first_entry(&hwq->activeStreamQueue[__fls(map)],
+				struct stqueue_info, list);
 }
 
-static long ravb_unmap_page_compat(struct file *file, unsigned long parm)
+static void rr_sent(struct hwqueue_info *hwq, struct ravb_encode_pass *ep,
+		    struct stqueue_info *stq, u32 bytes)
 {
-	struct eavb_dma_alloc_compat dma32;
-	struct eavb_dma_alloc __user *pdma;
+	list_move_tail(&stq->list, &hwq->activeStreamQueue[stq->priority]);
+}
+
+static const struct ravb_sched_ops ravb_sched_rr = {
+	.name = "rr",
+	.dequeue = rr_dequeue,
+	.sent = rr_sent,
+};
+
+/* deficit round robin, byte fair within a level */
+static void drr_attach(struct hwqueue_info *hwq, struct stqueue_info *stq)
+{
+	/* no credit carried over from another scheduler */
+	stq->schedInfo.deficit = 0;
+	stq->schedInfo.replenish = true;
+}
+
+static void drr_enqueue(struct hwqueue_info *hwq, struct stqueue_info *stq)
+{
+	/* an idle stream queue keeps no credit */
+	stq->schedInfo.deficit = 0;
+	stq->schedInfo.replenish = true;
+}
+
+static struct stqueue_info *drr_dequeue(struct hwqueue_info *hwq,
+					struct ravb_encode_pass *ep)
+{
+	struct stqueue_info *stq;
+	struct stream_entry *e;
+	struct schedule_info *sched;
+	struct list_head *active;
+
+	while (hwq->activePrioMap & ep->open) {
+		active = &hwq->activeStreamQueue[__fls(hwq->activePrioMap &
+						       ep->open)];
+		stq = list_first_entry(active, struct stqueue_info, list);
+		e = list_first_entry(&stq->entryWaitQueue,
+				     struct stream_entry,
+				     list);
+		sched = &stq->schedInfo;
 
-	if (copy_from_user(&dma32, (void __user *)parm, sizeof(dma32)))
-		return -EFAULT;
+		if (sched->replenish) {
+			sched->deficit += stq_drr_quantum(stq);
+			sched->replenish = false;
+		}
 
-	pdma = compat_alloc_user_space(sizeof(*pdma));
-	if (!access_ok(pdma, sizeof(*pdma)))
-		return -EFAULT;
-	if (__put_user(dma32.dma_paddr, &pdma->dma_paddr) ||
-	    __put_user((void __user *)(unsigned long)dma32.dma_vaddr,
-		       &pdma->dma_vaddr) ||
-	    __put_user(dma32.mmap_size, &pdma->mmap_size))
-		return -EFAULT;
+		/* not enough credit left, wait for the next round */
+		if (entry_bytes(e) > sched->deficit) {
+			sched->replenish = true;
+			list_move_tail(&stq->list, active);
+			continue;
+		}
 
-	return ravb_unmap_page(file, (unsigned long)(pdma));
+		return stq;
+	}
+
+	return NULL;
 }
 
-static long ravb_streaming_ioctl_compat(struct file *file,
-					unsigned int cmd, unsigned long parm)
+static void drr_sent(struct hwqueue_info *hwq, struct ravb_encode_pass *ep,
+		     struct stqueue_info *stq, u32 bytes)
 {
-	switch (cmd) {
-	case EAVB_MAPPAGE_COMPAT:
-		return ravb_map_page_compat(file, parm);
-	case EAVB_UNMAPPAGE_COMPAT:
-		return ravb_unmap_page_compat(file, parm);
-	default:
-		return ravb_streaming_ioctl(file, cmd, parm);
-	}
+	stq->schedInfo.deficit -= bytes;
 }
-#endif
 
-static const struct file_operations ravb_streaming_fops = {
-	.owner		= THIS_MODULE,
-	.open		= ravb_streaming_open,
-	.release	= ravb_streaming_release,
-	.read		= ravb_streaming_read,
-	.write		= ravb_streaming_write,
-	.poll		= ravb_streaming_poll,
-	.mmap       = ravb_streaming_mmap,
-	.unlocked_ioctl	= ravb_streaming_ioctl,
-#ifdef CONFIG_COMPAT
-	.compat_ioctl	= ravb_streaming_ioctl_compat,
-#endif
+static const struct ravb_sched_ops ravb_sched_drr = {
+	.name = "drr",
+	.attach = drr_attach,
+	.enqueue = drr_enqueue,
+	.dequeue = drr_dequeue,
+	.sent = drr_sent,
 };
 
-static inline int ravb_control_interrupt(struct net_device *ndev,
-					 struct hwqueue_info *hwq,
-					 bool enable)
+/**
+ * earliest deadline first across stream queues
+ *
+ * The deadline of an entry is its launch time, entries without one come
+ * last. Entries of a stream queue are sent in order, so a min-heap of the
+ * active stream queues keyed by the deadline of their head entry yields
+ * the entry due first. Equal deadlines go by priority. The heap is built
+ * on the first pick of a pass, and the top is sifted down on each pick
+ * after its head entry changed.
+ */
+static u64 stq_deadline(struct stqueue_info *stq)
 {
-	struct ravb_private *priv = netdev_priv(ndev);
-	u32 ofs, val;
-	unsigned long flags;
+	struct stream_entry *e;
 
-	avb_spin_lock_irqsave(&priv->lock, flags, hwq->index, -1);
-	ofs = (hwq->tx) ? TIC : RIC0;
-	val = ravb_read(ndev, ofs);
-	if (enable)
-		ravb_write(ndev, (val | (1 << hwq->chno)), ofs);
-	else
-		ravb_write(ndev, (val & ~(1 << hwq->chno)), ofs);
-	avb_spin_unlock_irqrestore(&priv->lock, flags, hwq->index, -1);
+	e = list_first_entry(&stq->entryWaitQueue, struct stream_entry, list);
 
-	return 0;
+	return e->launch_time ? e->launch_time : U64_MAX;
 }
 
-static inline int ravb_enable_interrupt(struct net_device *ndev,
-					struct hwqueue_info *hwq)
+static bool edf_before(struct stqueue_info *a, struct stqueue_info *b)
 {
-	struct ravb_private *priv = netdev_priv(ndev);
+	u64 da = stq_deadline(a), db = stq_deadline(b);
 
-	if (priv->chip_id == RCAR_GEN3) {
-		if (hwq->tx)
-			ravb_write(ndev, BIT(hwq->chno + TDP_BIT_OFFSET), TIE);
-		else
-			ravb_write(ndev, BIT(hwq->chno + RDP_BIT_OFFSET), RIE3);
+	if (da != db)
+		return da < db;
 
-		/* if irq timeout isn't zero, start irq timeout timer */
-		hwq_try_to_start_irq_timeout_timer(hwq);
+	return a->priority > b->priority;
+}
 
-		return 0;
+static void edf_sift_down(struct stqueue_info **heap, int n, int i)
+{
+	int l, r, m;
+
+	for (;;) {
+		l = 2 * i + 1;
+		r = l + 1;
+		m = i;
+		if (l < n && edf_before(heap[l], heap[m]))
+			m = l;
+		if (r < n && edf_before(heap[r], heap[m]))
+			m = r;
+		if (m == i)
+			break;
+		swap(heap[i], heap[m]);
+		i = m;
 	}
-
-	return ravb_control_interrupt(ndev, hwq, true);
 }
 
-static inline int ravb_disable_interrupt(struct net_device *ndev,
-					 struct hwqueue_info *hwq)
+static struct stqueue_info *edf_dequeue(struct hwqueue_info *hwq,
+					struct ravb_encode_pass *ep)
 {
-	struct ravb_private *priv = netdev_priv(ndev);
-
-	if (priv->chip_id == RCAR_GEN3) {
-		if (hwq->tx)
-			ravb_write(ndev, BIT(hwq->chno + TDP_BIT_OFFSET), TID);
-		else
-			ravb_write(ndev, BIT(hwq->chno + RDP_BIT_OFFSET), RID3);
-
-		return 0;
+	struct stqueue_info **heap = ep->edf.heap;
+	struct stqueue_info *stq;
+	int prio, i;
+
+	if (!ep->edf.built) {
+		ep->edf.built = true;
+		ep->edf.num = 0;
+		for_each_set_bit(prio, &hwq->activePrioMap,
+				 RAVB_STQUEUE_PRIO_NUM) {
+			if (!test_bit(prio, &ep->open))
+				continue;
+			list_for_each_entry(stq, &hwq->activeStreamQueue[prio],
+					    list)
+				heap[ep->edf.num++] = stq;
+		}
+		for (i = ep->edf.num / 2 - 1; i >= 0; i--)
+			edf_sift_down(heap, ep->edf.num, i);
+	} else {
+		edf_sift_down(heap, ep->edf.num, 0);
 	}
 
-	return ravb_control_interrupt(ndev, hwq, false);
+	return ep->edf.num ? heap[0] : NULL;
 }
 
-static inline int ravb_reload_chain(struct net_device *ndev, int index)
+/* only the last pick leaves in the middle of a pass */
+static void edf_remove(struct hwqueue_info *hwq, struct ravb_encode_pass *ep,
+		       struct stqueue_info *stq)
 {
-	u32 loadmask = 1 << index;
+	ep->edf.heap[0] = ep->edf.heap[--ep->edf.num];
+}
 
-	/* if not OPERATION mode, doesn't need reload chain */
-	if ((ravb_read(ndev, CSR) & CSR_OPS) != CSR_OPS_OPERATION)
-		return 0;
+static const struct ravb_sched_ops ravb_sched_edf = {
+	.name = "edf",
+	.dequeue = edf_dequeue,
+	.remove = edf_remove,
+};
 
-	ravb_write(ndev, loadmask, DLR);
-	while (ravb_read(ndev, DLR) & loadmask)
-		;
+static const struct ravb_sched_ops *ravb_sched_table[] = {
+	&ravb_sched_rr,
+	&ravb_sched_drr,
+	&ravb_sched_edf,
+};
 
-	return 0;
+ssize_t avb_scheduler_show(struct hwqueue_info *hwq, char *page)
+{
+	const struct ravb_sched_ops *ops;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ravb_sched_table); i++) {
+		ops = ravb_sched_table[i];
+		len += snprintf(page + len, PAGE_SIZE - 1 - len,
+				(ops == hwq->sched) ? "[%s] " : "%s ",
+				ops->name);
+	}
+	page[len - 1] = '\n';
+
+	return len;
 }
 
-static int hwq_task_process_terminate(struct hwqueue_info *hwq)
+/* The scheduler can only be switched while the hwqueue has no entries */
+int avb_scheduler_store(struct hwqueue_info *hwq, const char *name)
 {
-	struct streaming_private *stp = to_stp(hwq->device.parent);
-	struct net_device *ndev = to_net_dev(stp->device.parent);
-	struct ravb_private *priv = netdev_priv(ndev);
-	struct ravb_desc *desc;
-	struct stqueue_info *stq, *stq1;
-	struct stream_entry *e, *e1;
-	struct stqueue_info *stq_pool[RAVB_STQUEUE_NUM] = { NULL };
-	int index, i;
-
-	if (unlikely(hwq->defunct)) {
-		/* write EOS for hw terminate */
-		index = hwq->qno;
-		desc = (struct ravb_desc *)&priv->desc_bat[index];
-		desc->die_dt = DT_EOS;
-		/* force reload chain */
-		ravb_reload_chain(ndev, index);
-		/* clear descriptor chain */
-		clear_desc(hwq);
-		/* write LINKFIX as restore chain */
-		desc->die_dt = DT_LINKFIX;
-		/* force reload chain */
-		ravb_reload_chain(ndev, index);
+	const struct ravb_sched_ops *ops = NULL;
+	struct stqueue_info *stq;
+	int i, qno, err = 0;
 
-		/* flush activeStreamQueue */
-		list_for_each_entry_safe(stq, stq1, &hwq->activeStreamQueue, list) {
-			stq_pool[stq->qno] = stq;
-			list_del(&stq->list);
-		}
-		/* flush completeWaitQueue */
-		list_for_each_entry_safe(e, e1, &hwq->completeWaitQueue, list) {
-			stq_pool[e->stq->qno] = e->stq;
-			put_streaming_entry(e);
-		}
+	for (i = 0; i < ARRAY_SIZE(ravb_sched_table); i++) {
+		if (sysfs_streq(name, ravb_sched_table[i]->name))
+			ops = ravb_sched_table[i];
+	}
+	if (!ops)
+		return -EINVAL;
 
-		/* raise stream queue */
-		for (i = 0; i < RAVB_STQUEUE_NUM; i++) {
-			stq = stq_pool[i];
-			if (stq) {
-				stq_sequencer(stq, AVB_STATE_IDLE);
-				avb_wake_up_interruptible(&stq->waitEvent,
-							  hwq->index,
-							  stq->qno);
-			}
+	avb_down(&hwq->sem, hwq->index, -1);
+	if (hwq_is_active(hwq) || !list_empty(&hwq->completeWaitQueue)) {
+		err = -EBUSY;
+	} else if (ops != hwq->sched) {
+		/* open stream queues move over to the new scheduler */
+		for_each_set_bit(qno, hwq->stream_map, RAVB_STQUEUE_NUM) {
+			stq = hwq->stqueueInfoTable[qno];
+			if (hwq->sched->detach)
+				hwq->sched->detach(hwq, stq);
+			if (ops->attach)
+				ops->attach(hwq, stq);
 		}
+		hwq->sched = ops;
 	}
+	avb_up(&hwq->sem, hwq->index, -1);
 
-	return 0;
+	return err;
 }
 
 static int hwq_task_process_encode(struct hwqueue_info *hwq)
 {
-	struct stqueue_info *stq;
-	struct stream_entry *e;
+	const struct ravb_sched_ops *ops = hwq->sched;
 	struct streaming_private *stp = stp_ptr;
 	struct net_device *ndev = to_net_dev(stp->device.parent);
-	bool irq_enable = false;
+	struct ravb_encode_pass ep;
+	struct stqueue_info *stq;
+	struct stream_entry *e;
+	bool last;
+	u32 bytes;
+
+	encode_pass_begin(hwq, &ep);
 
-	while (hwq->remain >= EAVB_ENTRYVECNUM &&
-	       !list_empty(&hwq->activeStreamQueue)) {
-		stq = list_first_entry(&hwq->activeStreamQueue,
-				       struct stqueue_info,
-				       list);
+	while ((stq = ops->dequeue(hwq, &ep))) {
 		e = list_first_entry(&stq->entryWaitQueue,
 				     struct stream_entry,
 				     list);
 
-		if (irq_enable)
-			pr_err("Unexpected loop continuation...\n");
+		if (encode_pass_hold(hwq, &ep, stq, e)) {
+			if (ops->remove)
+				ops->remove(hwq, &ep, stq);
+			continue;
+		}
 
-		if ((list_is_last(&stq->list, &hwq->activeStreamQueue) &&
-		     list_is_last(&e->list, &stq->entryWaitQueue)) ||
-		     hwq->remain < e->vecsize + EAVB_ENTRYVECNUM)
-			irq_enable = true;
+		encode_pass_stq(hwq, stq);
 
-		desc_copy(hwq, e, irq_enable);
-		trace_avb_entry_encode(e);
-		list_move_tail(&e->list, &hwq->completeWaitQueue);
-		stq->entrynum.processed++;
+		/* all descriptors of a frame must be free at once */
+		if (hwq->remain < e->vecsize || hwq->draining) {
+			hwq_account_starved(hwq, ep.open, stq->priority);
+			ep.ring_full = true;
+			break;
+		}
 
-		if (hwq->tx)
-			stq->dstats.tx_entry_wait--;
-		else
-			stq->dstats.rx_entry_wait--;
+		last = (hwq->activePrioMap & ep.open) == BIT(stq->priority) &&
+			list_is_singular(&hwq->activeStreamQueue[stq->priority]) &&
+			list_is_last(&e->list, &stq->entryWaitQueue);
 
-		if (list_empty(&stq->entryWaitQueue)) {
-			list_del(&stq->list);
-			stq_sequencer(stq, AVB_STATE_WAITCOMPLETE);
-		} else {
-			list_move_tail(&stq->list, &hwq->activeStreamQueue);
+		bytes = entry_bytes(e);
+		if (ops->sent)
+			ops->sent(hwq, &ep, stq, bytes);
+		if (encode_pass_entry(hwq, &ep, stq, e, bytes, last) &&
+		    ops->remove)
+			ops->remove(hwq, &ep, stq);
+
+		if (ring_above(hwq, ep.high, ep.high_bytes)) {
+			hwq->draining = true;
+			ep.ring_full = true;
+			break;
 		}
+
+		if (encode_pass_done(&ep))
+			break;
 	}
 
+	encode_pass_end(hwq, &ep);
+
 	if (hwq->tx) {
 		/* transmission start request */
 		ravb_write(ndev,
@@ -2429,6 +5682,22 @@ static int hwq_task_process_encode(struct hwqueue_info *hwq)
 	return 0;
 }
 
+/* Account the latency from the interrupt to the first reader wakeup */
+static void hwq_account_wakeup(struct hwqueue_info *hwq)
+{
+	u64 stamp = READ_ONCE(hwq->irq_stamp);
+	u64 usec;
+	int bucket;
+
+	if (!stamp)
+		return;
+
+	usec = div_u64(ktime_get_ns() - stamp, NSEC_PER_USEC);
+	bucket = usec ? min(fls64(usec), RAVB_LATENCY_BUCKETS - 1) : 0;
+	hwq->wakeup_latency[bucket]++;
+	hwq->irq_stamp = 0;
+}
+
 static int hwq_task_process_decode(struct hwqueue_info *hwq)
 {
 	struct stqueue_info *stq;
@@ -2449,8 +5718,10 @@ static int hwq_task_process_decode(struct hwqueue_info *hwq)
 		list_move_tail(&e->list, &stq->entryLogQueue);
 		stq->entrynum.processed--;
 		stq->entrynum.completed++;
+		hwq->coalesce.completed++;
 
 		if (hwq->tx) {
+			hwq->inflight_bytes -= entry_bytes(e);
 			stq->dstats.tx_entry_complete++;
 			stq->pstats.tx_packets++;
 			stq->pstats.tx_errors += (u64)e->errors;
@@ -2471,35 +5742,128 @@ static int hwq_task_process_decode(struct hwqueue_info *hwq)
 
 	for (i = 0; i < RAVB_STQUEUE_NUM; i++) {
 		stq = stq_pool[i];
-		if (stq)
+		if (stq) {
+			hwq_account_wakeup(hwq);
 			avb_wake_up_interruptible(&stq->waitEvent,
 						  hwq->index, stq->qno);
+		}
 	}
+	hwq->irq_stamp = 0;
+
+	hwq_coalesce_sample(hwq);
 
 	return progress;
 }
 
-static int hwq_task_process_judge(struct hwqueue_info *hwq, bool progress)
+static void hwq_task_process_ring(struct hwqueue_info *hwq)
+{
+	struct stqueue_info *stq;
+	int qno;
+
+	for_each_set_bit(qno, hwq->stream_map, RAVB_STQUEUE_NUM) {
+		stq = hwq->stqueueInfoTable[qno];
+		if (!stq->ring)
+			continue;
+
+		if (!stq_ring_service(stq))
+			continue;
+
+		stq_uring_complete(stq, stq_ring_cq_count(stq));
+		avb_wake_up_interruptible(&stq->waitEvent,
+					  hwq->index, stq->qno);
+	}
+}
+
+/**
+ * busy poll
+ *
+ * With a spin budget set, the task waits for the next completion by
+ * polling the descriptor of the oldest entry in flight with interrupts
+ * kept masked, saving the interrupt and the task wakeup. A poll running
+ * out of budget, or wanted off the CPU, falls back to the interrupt.
+ */
+static bool hwq_entry_completed(struct hwqueue_info *hwq)
+{
+	struct stream_entry *e;
+	struct ravb_desc *desc = NULL;
+	u8 dt;
+	int i;
+
+	e = list_first_entry_or_null(&hwq->completeWaitQueue,
+				     struct stream_entry, list);
+	if (!e)
+		return true;
+	for (i = 0; i < e->vecsize && !desc; i++)
+		desc = e->descs[i];
+	if (!desc)
+		return true;
+
+	dt = READ_ONCE(desc->die_dt) & 0xf0;
+
+	return hwq->tx ? (dt == DT_FEMPTY) : (dt != DT_FEMPTY);
+}
+
+/* Returns true if a completion was found, without holding hwq->sem */
+static bool hwq_busy_poll(struct hwqueue_info *hwq)
+{
+	u64 deadline;
+
+	deadline = ktime_get_ns() +
+		(u64)READ_ONCE(hwq->busy_poll_usec) * NSEC_PER_USEC;
+
+	do {
+		/* leave events, unload among them, to the task loop */
+		if (READ_ONCE(hwq->pendingEvents))
+			return false;
+
+		/* nothing left to wait for, back to the task loop */
+		if (list_empty(&hwq->completeWaitQueue))
+			return true;
+
+		if (hwq_entry_completed(hwq)) {
+			hwq->dstats.poll_hits++;
+			return true;
+		}
+
+		cpu_relax();
+	} while (!need_resched() && ktime_get_ns() < deadline);
+
+	hwq->dstats.poll_misses++;
+
+	return false;
+}
+
+static void hwq_wait_complete(struct hwqueue_info *hwq)
 {
 	struct streaming_private *stp = to_stp(hwq->device.parent);
 	struct net_device *ndev = to_net_dev(stp->device.parent);
 
-	if (list_empty(&hwq->activeStreamQueue)) {
+	hwq_sequencer(hwq, AVB_STATE_WAITCOMPLETE);
+
+	hwq->polling = READ_ONCE(hwq->busy_poll_usec) &&
+		!list_empty(&hwq->completeWaitQueue);
+	if (!hwq->polling) {
+		/* enable interrupt */
+		ravb_enable_interrupt(ndev, hwq);
+	}
+}
+
+static int hwq_task_process_judge(struct hwqueue_info *hwq, bool progress)
+{
+	if (!hwq_is_active(hwq)) {
 		if (list_empty(&hwq->completeWaitQueue)) {
 			hwq->defunct = 0;
 			hwq_sequencer(hwq, AVB_STATE_IDLE);
 		} else {
-			hwq_sequencer(hwq, AVB_STATE_WAITCOMPLETE);
-			/* enable interrupt */
-			ravb_enable_interrupt(ndev, hwq);
+			hwq_wait_complete(hwq);
 		}
 	} else {
-		if (!progress && list_empty(&hwq->completeWaitQueue)) {
+		if (hwq->yielded ||
+		    (!progress && list_empty(&hwq->completeWaitQueue) &&
+		     !hwq->gated)) {
 			hwq_sequencer(hwq, AVB_STATE_ACTIVE);
 		} else {
-			hwq_sequencer(hwq, AVB_STATE_WAITCOMPLETE);
-			/* enable interrupt */
-			ravb_enable_interrupt(ndev, hwq);
+			hwq_wait_complete(hwq);
 		}
 	}
 
@@ -2548,7 +5912,7 @@ static int ravb_hwq_task(void *param)
 
 		switch (hwq->state) {
 		case AVB_STATE_IDLE:
-			if (list_empty(&hwq->activeStreamQueue))
+			if (!hwq_is_active(hwq))
 				break;
 			/* fall through */
 		case AVB_STATE_WAITCOMPLETE:
@@ -2557,7 +5921,6 @@ static int ravb_hwq_task(void *param)
 			hwq_sequencer(hwq, AVB_STATE_ACTIVE);
 			/* fall through */
 		case AVB_STATE_ACTIVE:
-			/* TODO implement SW scheduler */
 			do {
 				avb_down(&hwq->sem, hwq->index, -1);
 
@@ -2567,10 +5930,31 @@ static int ravb_hwq_task(void *param)
 				hwq_task_process_encode(hwq);
 				/* process completed descriptor by HW */
 				progress = hwq_task_process_decode(hwq);
+				/* exchange entries with shared memory rings */
+				hwq_task_process_ring(hwq);
 				/* judge hwq Task state */
 				hwq_task_process_judge(hwq, progress);
 
 				avb_up(&hwq->sem, hwq->index, -1);
+
+				/*
+				 * The IRQ thread leaves completeWaitQueue to
+				 * a polling task until polling is cleared
+				 * under hwq->sem after the spin.
+				 */
+				if (hwq->polling) {
+					bool hit = hwq_busy_poll(hwq);
+
+					avb_down(&hwq->sem, hwq->index, -1);
+					hwq->polling = false;
+					if (hit)
+						hwq_sequencer(hwq,
+							      AVB_STATE_ACTIVE);
+					else
+						ravb_enable_interrupt(ndev,
+								      hwq);
+					avb_up(&hwq->sem, hwq->index, -1);
+				}
 			} while (hwq->state == AVB_STATE_ACTIVE);
 			break;
 		default:
@@ -2631,6 +6015,8 @@ static irqreturn_t ravb_streaming_interrupt(int irq, void *dev_id)
 			hwq_event_irq(hwq, AVB_EVENT_TXINT, index);
 
 			hwq->dstats.tx_interrupts++;
+			if (!hwq->irq_stamp)
+				hwq->irq_stamp = ktime_get_ns();
 
 			ret = IRQ_HANDLED;
 		}
@@ -2654,6 +6040,8 @@ static irqreturn_t ravb_streaming_interrupt(int irq, void *dev_id)
 			hwq_event_irq(hwq, AVB_EVENT_RXINT, index);
 
 			hwq->dstats.rx_interrupts++;
+			if (!hwq->irq_stamp)
+				hwq->irq_stamp = ktime_get_ns();
 
 			ret = IRQ_HANDLED;
 		}
@@ -2679,12 +6067,17 @@ static irqreturn_t ravb_streaming_interrupt_rxtx(int irq, void *dev_id)
 	if (irq != hwq->irq)
 		return IRQ_NONE;
 
+	if (!hwq->irq_stamp)
+		hwq->irq_stamp = ktime_get_ns();
+
 	if (hwq->tx) {
-		hwq_event_irq(hwq, AVB_EVENT_TXINT, hwq->index);
+		if (!irq_threaded)
+			hwq_event_irq(hwq, AVB_EVENT_TXINT, hwq->index);
 		hwq->dstats.tx_interrupts++;
 		ravb_write(ndev, ~BIT(hwq->chno + TDP_BIT_OFFSET), TIS);
 	} else {
-		hwq_event_irq(hwq, AVB_EVENT_RXINT, hwq->index);
+		if (!irq_threaded)
+			hwq_event_irq(hwq, AVB_EVENT_RXINT, hwq->index);
 		hwq->dstats.rx_interrupts++;
 		ravb_write(ndev, ~BIT(hwq->chno + RDP_BIT_OFFSET), RIS3);
 	}
@@ -2692,6 +6085,45 @@ static irqreturn_t ravb_streaming_interrupt_rxtx(int irq, void *dev_id)
 	/* if irq timeout isn't zero, start irq timeout timer */
 	hwq_try_to_start_irq_timeout_timer(hwq);
 
+	return irq_threaded ? IRQ_WAKE_THREAD : IRQ_HANDLED;
+}
+
+/**
+ * threaded interrupt
+ *
+ * With irq_threaded, the IRQ thread decodes the completions of a hwqueue
+ * waiting on interrupts and wakes the readers itself, saving the hop
+ * through the hwqueue task. The task is only woken when there are
+ * entries left to encode, or when it is not waiting on interrupts.
+ */
+static irqreturn_t ravb_streaming_irq_thread(int irq, void *dev_id)
+{
+	struct hwqueue_info *hwq = dev_id;
+	struct streaming_private *stp = to_stp(hwq->device.parent);
+	struct net_device *ndev = to_net_dev(stp->device.parent);
+	bool kick = true;
+
+	avb_down(&hwq->sem, hwq->index, -1);
+
+	/* a busy polling task owns completeWaitQueue */
+	if (hwq->state == AVB_STATE_WAITCOMPLETE && !hwq->polling) {
+		hwq_task_process_decode(hwq);
+		hwq_task_process_ring(hwq);
+
+		kick = hwq_is_active(hwq);
+		if (!kick && list_empty(&hwq->completeWaitQueue)) {
+			ravb_disable_interrupt(ndev, hwq);
+			hwq->defunct = 0;
+			hwq_sequencer(hwq, AVB_STATE_IDLE);
+		}
+	}
+
+	avb_up(&hwq->sem, hwq->index, -1);
+
+	if (kick)
+		hwq_event(hwq, hwq->tx ? AVB_EVENT_TXINT : AVB_EVENT_RXINT,
+			  hwq->index);
+
 	return IRQ_HANDLED;
 }
 
@@ -2758,7 +6190,7 @@ static inline bool match_dev(struct net_device *ndev)
 static int ravb_streaming_init(void)
 {
 	int err = -ENODEV;
-	int i;
+	int i, j;
 	struct net_device *ndev = NULL;
 	struct ravb_private *priv;
 	struct streaming_private *stp;
@@ -2820,7 +6252,11 @@ static int ravb_streaming_init(void)
 	stp_ptr = stp;
 
 	/* create class */
+#if KERNEL_VERSION(6, 4, 0) <= LINUX_VERSION_CODE
+	stp->avb_class = class_create("avb");
+#else
 	stp->avb_class = class_create(THIS_MODULE, "avb");
+#endif
 	if (IS_ERR(stp->avb_class)) {
 		err = PTR_ERR_OR_ZERO(stp->avb_class);
 		pr_err("init: failed to create avb class\n");
@@ -2866,14 +6302,9 @@ static int ravb_streaming_init(void)
 	/* initialize streaming private */
 	sema_init(&stp->sem, 1);
 
-	/* create entry cache */
-	streaming_entry_cache = kmem_cache_create("avb_entry_cache",
-						  sizeof(struct stream_entry),
-						  0,
-						  0,
-						  NULL);
-
 	INIT_LIST_HEAD(&stp->userpages);
+	stp->regions = RB_ROOT;
+	spin_lock_init(&stp->region_lock);
 
 	/* device initialize */
 	dev = &stp->device;
@@ -2889,7 +6320,7 @@ static int ravb_streaming_init(void)
 	err = device_add(dev);
 	if (err) {
 		pr_err("init: failed to add device, err=%d\n", err);
-		goto err_initstp;
+		goto err_initdevice;
 	}
 
 	if (priv->chip_id == RCAR_GEN2) {
@@ -2939,12 +6370,12 @@ static int ravb_streaming_init(void)
 		/* clear descriptor chain */
 		clear_desc(hwq);
 		hwq->minremain = hwq->remain;
-		hwq->irq_coalesce_frame_count = (hwq->tx) ?
-			irq_coalesce_frame_tx : irq_coalesce_frame_rx;
+		hwq_coalesce_init(hwq);
 
 		sema_init(&hwq->sem, 1);
 		init_waitqueue_head(&hwq->waitEvent);
-		INIT_LIST_HEAD(&hwq->activeStreamQueue);
+		for (j = 0; j < RAVB_STQUEUE_PRIO_NUM; j++)
+			INIT_LIST_HEAD(&hwq->activeStreamQueue[j]);
 		INIT_LIST_HEAD(&hwq->completeWaitQueue);
 
 		/* device initialize */
@@ -2975,6 +6406,15 @@ static int ravb_streaming_init(void)
 			goto err_inithwqueue;
 		}
 
+		/* armed by the task, so ready before it runs */
+		hrtimer_init(&hwq->launch_timer, CLOCK_TAI, HRTIMER_MODE_ABS);
+		hwq->launch_timer.function = ravb_streaming_launch_handler;
+		hrtimer_init(&hwq->gate.timer, CLOCK_TAI, HRTIMER_MODE_ABS);
+		hwq->gate.timer.function = ravb_streaming_gate_handler;
+		hwq->gate.index = -1;
+		hwq->gate.mask = RAVB_GATE_ALL_OPEN;
+		hwq->sched = &ravb_sched_drr;
+
 		sprintf(taskname, hwq_name(hwq));
 		hwq->task = kthread_run(ravb_hwq_task, hwq, taskname);
 		if (IS_ERR(hwq->task)) {
@@ -2990,11 +6430,15 @@ static int ravb_streaming_init(void)
 				pr_warn("limit avb_rt_prio %d to max %d\n", avb_rt_prio, MAX_RT_PRIO - 1);
 				avb_rt_prio = MAX_RT_PRIO - 1;
 			}
-			if (avb_rt_prio >= (MAX_RT_PRIO / 2))
+			if (avb_rt_prio >= (MAX_RT_PRIO / 2)) {
 				sched_set_fifo (hwq->task);
-			else
+				hwq->rt_prio = MAX_RT_PRIO / 2;
+			} else {
 				sched_set_fifo_low (hwq->task);
+				hwq->rt_prio = 1;
+			}
 		}
+		cpumask_copy(&hwq->cpus, cpu_possible_mask);
 
 		hrtimer_init(&hwq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 		hwq->timer.function = ravb_streaming_timer_handler;
@@ -3011,12 +6455,16 @@ static int ravb_streaming_init(void)
 			irq_name2 = devm_kasprintf(dev, GFP_KERNEL,
 						   "%s:%s:%s", ndev->name,
 						   irq_name, hwq_name(hwq));
-			err = devm_request_irq(dev,
-					       irq,
-					       ravb_streaming_interrupt_rxtx,
-					       0,
-					       irq_name2,
-					       hwq);
+			err = devm_request_threaded_irq(dev,
+							irq,
+							ravb_streaming_interrupt_rxtx,
+							irq_threaded ?
+							ravb_streaming_irq_thread :
+							NULL,
+							irq_threaded ?
+							IRQF_ONESHOT : 0,
+							irq_name2,
+							hwq);
 			if (err) {
 				pr_err("request_irq(%d,%s) error\n",
 				       irq, irq_name2);
@@ -3036,7 +6484,10 @@ err_inithwqueue:
 		if (hwq->task) {
 			hwq_event(hwq, AVB_EVENT_UNLOAD, -1);
 			kthread_stop(hwq->task);
+			hrtimer_cancel(&hwq->launch_timer);
+			hrtimer_cancel(&hwq->gate.timer);
 		}
+		hwq_irq_clear_affinity(hwq);
 		if (hwq->attached)
 			kset_unregister(hwq->attached);
 		if (hwq->device_add_flag)
@@ -3044,7 +6495,7 @@ err_inithwqueue:
 
 		if (hwq->ring) {
 			dma_free_coherent(pdev_dev,
-					  (hwq->ringsize + 1) * sizeof(*desc),
+					  RAVB_RINGSIZE * sizeof(*desc),
 					  hwq->ring,
 					  hwq->ring_dma);
 		}
@@ -3054,8 +6505,6 @@ err_inithwqueue:
 	}
 err_initirq:
 	device_unregister(&stp->device);
-err_initstp:
-	kmem_cache_destroy(streaming_entry_cache);
 err_initdevice:
 	cdev_del(&stp->cdev);
 no_register:
@@ -3102,7 +6551,10 @@ static void ravb_streaming_cleanup(void)
 		if (hwq->task) {
 			hwq_event(hwq, AVB_EVENT_UNLOAD, -1);
 			kthread_stop(hwq->task);
+			hrtimer_cancel(&hwq->launch_timer);
+			hrtimer_cancel(&hwq->gate.timer);
 		}
+		hwq_irq_clear_affinity(hwq);
 
 		/* write EOS for hw terminate */
 		desc = (struct ravb_desc *)&priv->desc_bat[hwq->qno];
@@ -3110,13 +6562,14 @@ static void ravb_streaming_cleanup(void)
 		/* force reload chain */
 		ravb_reload_chain(ndev, hwq->qno);
 
+		/* entries return to the pools of their stream queues */
+		list_for_each_entry_safe(e, e1, &hwq->completeWaitQueue, list)
+			put_streaming_entry(e);
+
 		/* cleanup stream queue info */
 		for (j = 0; j < ((hwq->tx) ? RAVB_STQUEUE_NUM : 1); j++)
 			if (test_and_clear_bit(j, hwq->stream_map))
 				put_stq(hwq->stqueueInfoTable[j]);
-
-		list_for_each_entry_safe(e, e1, &hwq->completeWaitQueue, list)
-			put_streaming_entry(e);
 		if (hwq->attached)
 			kset_unregister(hwq->attached);
 		if (hwq->device_add_flag)
@@ -3124,7 +6577,7 @@ static void ravb_streaming_cleanup(void)
 
 		if (hwq->ring) {
 			dma_free_coherent(pdev_dev,
-					  (hwq->ringsize + 1) * sizeof(*desc),
+					  RAVB_RINGSIZE * sizeof(*desc),
 					  hwq->ring,
 					  hwq->ring_dma);
 		}
@@ -3133,9 +6586,6 @@ static void ravb_streaming_cleanup(void)
 	device_unregister(&stp->device);
 	class_destroy(stp->avb_class);
 
-	/* destroy entry cache */
-	kmem_cache_destroy(streaming_entry_cache);
-
 	/* cleanup user pages */
 	list_for_each_entry_safe(userpage, userpage1, &stp->userpages, list)
 		put_userpage(userpage);
@@ -3155,3 +6605,8 @@ module_exit(ravb_streaming_cleanup);
 MODULE_AUTHOR("Renesas Electronics Corporation");
 MODULE_DESCRIPTION("Renesas AVB Streaming Driver");
 MODULE_LICENSE("Dual MIT/GPL");
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+MODULE_IMPORT_NS("DMA_BUF");
+#elif KERNEL_VERSION(5, 16, 0) <= LINUX_VERSION_CODE
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
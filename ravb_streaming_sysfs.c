@@ -67,6 +67,7 @@
 #include <linux/phy.h>
 #include <linux/slab.h>
 #include <linux/cdev.h>
+#include <linux/cpumask.h>
 #include <linux/kobject.h>
 #include <linux/string.h>
 #include <linux/sysfs.h>
@@ -172,6 +173,30 @@ static ssize_t hwq_##_name##_show(struct device *dev, \
 	return snprintf(page, PAGE_SIZE - 1, "%d\n", hwq->_name); \
 }
 
+#define HWQ_SHOW_U32(_name) \
+static ssize_t hwq_##_name##_show(struct device *dev, \
+			   struct device_attribute *attr, char *page) \
+{ \
+	struct hwqueue_info *hwq = dev_get_drvdata(dev); \
+	return snprintf(page, PAGE_SIZE - 1, "%u\n", hwq->_name); \
+}
+
+#define HWQ_STORE_U32(_name) \
+static ssize_t hwq_##_name##_store(struct device *dev, \
+			   struct device_attribute *attr, \
+			   const char *buf, size_t count) \
+{ \
+	struct hwqueue_info *hwq = dev_get_drvdata(dev); \
+	u32 val; \
+	int err; \
+\
+	err = kstrtou32(buf, 0, &val); \
+	if (err) \
+		return err; \
+	WRITE_ONCE(hwq->_name, val); \
+	return count; \
+}
+
 #define HWQ_ATTR_RO(_name) \
 struct device_attribute hwq_##_name##_attribute = { \
 	.attr	= { .name = __stringify(_name), .mode = 0444 }, \
@@ -200,12 +225,177 @@ HWQ_SHOW_INT(index);
 HWQ_SHOW_BOOL(tx);
 HWQ_SHOW_INT(qno);
 HWQ_SHOW_INT(chno);
+HWQ_SHOW_U32(busy_poll_usec);
+HWQ_SHOW_INT(rt_prio);
+
+static ssize_t hwq_busy_poll_usec_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct hwqueue_info *hwq = dev_get_drvdata(dev);
+	u32 val;
+	int err;
+
+	err = kstrtou32(buf, 0, &val);
+	if (err)
+		return err;
+	WRITE_ONCE(hwq->busy_poll_usec,
+		   min_t(u32, val, RAVB_BUSY_POLL_USEC_MAX));
+
+	return count;
+}
+
+static ssize_t hwq_scheduler_show(struct device *dev,
+				  struct device_attribute *attr,
+				  char *page)
+{
+	return avb_scheduler_show(dev_get_drvdata(dev), page);
+}
+
+static ssize_t hwq_scheduler_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int err;
+
+	err = avb_scheduler_store(dev_get_drvdata(dev), buf);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static ssize_t hwq_coalesce_adaptive_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *page)
+{
+	struct hwqueue_info *hwq = dev_get_drvdata(dev);
+
+	return snprintf(page, PAGE_SIZE - 1, "%d\n",
+			READ_ONCE(hwq->coalesce.adaptive));
+}
+
+static ssize_t hwq_coalesce_adaptive_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
+{
+	struct hwqueue_info *hwq = dev_get_drvdata(dev);
+	bool val;
+	int err;
+
+	err = kstrtobool(buf, &val);
+	if (err)
+		return err;
+	WRITE_ONCE(hwq->coalesce.adaptive, val);
+
+	return count;
+}
+
+/* ring size in descriptors, the LINKFIX closing the chain included */
+static ssize_t hwq_ring_size_show(struct device *dev,
+				  struct device_attribute *attr,
+				  char *page)
+{
+	struct hwqueue_info *hwq = dev_get_drvdata(dev);
+
+	return snprintf(page, PAGE_SIZE - 1, "%d\n", hwq->ringsize + 1);
+}
+
+static ssize_t hwq_ring_size_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	u32 val;
+	int err;
+
+	err = kstrtou32(buf, 0, &val);
+	if (err)
+		return err;
+	err = avb_set_ringsize(dev_get_drvdata(dev), val);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static ssize_t hwq_cpus_show(struct device *dev,
+			     struct device_attribute *attr,
+			     char *page)
+{
+	struct hwqueue_info *hwq = dev_get_drvdata(dev);
+
+	return snprintf(page, PAGE_SIZE - 1, "%*pbl\n",
+			cpumask_pr_args(&hwq->cpus));
+}
+
+static ssize_t hwq_cpus_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	cpumask_var_t cpus;
+	int err;
+
+	if (!alloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	err = cpulist_parse(buf, cpus);
+	if (!err)
+		err = avb_set_cpus(dev_get_drvdata(dev), cpus);
+	free_cpumask_var(cpus);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static ssize_t hwq_rt_prio_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int val;
+	int err;
+
+	err = kstrtoint(buf, 0, &val);
+	if (err)
+		return err;
+	err = avb_set_rt_prio(dev_get_drvdata(dev), val);
+	if (err)
+		return err;
+
+	return count;
+}
+
+#define HWQ_COALESCE_SHOW(_name, _field, _fmt) \
+static ssize_t hwq_##_name##_show(struct device *dev, \
+			   struct device_attribute *attr, \
+			   char *page) \
+{ \
+	struct hwqueue_info *hwq = dev_get_drvdata(dev); \
+\
+	return snprintf(page, PAGE_SIZE - 1, _fmt "\n", \
+			READ_ONCE(hwq->coalesce._field)); \
+}
+
+HWQ_COALESCE_SHOW(coalesce_frames, frames, "%d");
+HWQ_COALESCE_SHOW(coalesce_usec, usec, "%d");
+HWQ_COALESCE_SHOW(frame_rate, frame_rate, "%u");
+HWQ_COALESCE_SHOW(irq_rate, irq_rate, "%u");
 
 static HWQ_ATTR_RO(index);
 static HWQ_ATTR_RO(state);
 static HWQ_ATTR_RO(tx);
 static HWQ_ATTR_RO(qno);
 static HWQ_ATTR_RO(chno);
+static HWQ_ATTR(scheduler);
+static HWQ_ATTR(busy_poll_usec);
+static HWQ_ATTR(ring_size);
+static HWQ_ATTR(cpus);
+static HWQ_ATTR(rt_prio);
+static HWQ_ATTR(coalesce_adaptive);
+static HWQ_ATTR_RO(coalesce_frames);
+static HWQ_ATTR_RO(coalesce_usec);
+static HWQ_ATTR_RO(frame_rate);
+static HWQ_ATTR_RO(irq_rate);
 
 static struct attribute *hwq_dev_basic_attrs[] = {
 	&hwq_index_attribute.attr,
@@ -213,6 +403,16 @@ static struct attribute *hwq_dev_basic_attrs[] = {
 	&hwq_tx_attribute.attr,
 	&hwq_qno_attribute.attr,
 	&hwq_chno_attribute.attr,
+	&hwq_scheduler_attribute.attr,
+	&hwq_busy_poll_usec_attribute.attr,
+	&hwq_ring_size_attribute.attr,
+	&hwq_cpus_attribute.attr,
+	&hwq_rt_prio_attribute.attr,
+	&hwq_coalesce_adaptive_attribute.attr,
+	&hwq_coalesce_frames_attribute.attr,
+	&hwq_coalesce_usec_attribute.attr,
+	&hwq_frame_rate_attribute.attr,
+	&hwq_irq_rate_attribute.attr,
 	NULL,
 };
 
@@ -275,6 +475,62 @@ static struct attribute_group hwq_dev_rx_group = {
 	.attrs = hwq_dev_rx_attrs,
 };
 
+/* hwq tx attrs */
+static ssize_t hwq_gate_mask_show(struct device *dev,
+				  struct device_attribute *attr,
+				  char *page)
+{
+	struct hwqueue_info *hwq = dev_get_drvdata(dev);
+
+	return snprintf(page, PAGE_SIZE - 1, "0x%02x\n",
+			READ_ONCE(hwq->gate.mask));
+}
+
+HWQ_SHOW_U32(burst_entries);
+HWQ_STORE_U32(burst_entries);
+HWQ_SHOW_U32(burst_bytes);
+HWQ_STORE_U32(burst_bytes);
+HWQ_SHOW_U32(stq_burst_entries);
+HWQ_STORE_U32(stq_burst_entries);
+HWQ_SHOW_U32(stq_burst_bytes);
+HWQ_STORE_U32(stq_burst_bytes);
+
+static HWQ_ATTR_RO(gate_mask);
+HWQ_SHOW_U32(ring_high);
+HWQ_STORE_U32(ring_high);
+HWQ_SHOW_U32(ring_low);
+HWQ_STORE_U32(ring_low);
+HWQ_SHOW_U32(ring_high_usec);
+HWQ_STORE_U32(ring_high_usec);
+HWQ_SHOW_U32(ring_low_usec);
+HWQ_STORE_U32(ring_low_usec);
+
+static HWQ_ATTR(burst_entries);
+static HWQ_ATTR(burst_bytes);
+static HWQ_ATTR(stq_burst_entries);
+static HWQ_ATTR(stq_burst_bytes);
+static HWQ_ATTR(ring_high);
+static HWQ_ATTR(ring_low);
+static HWQ_ATTR(ring_high_usec);
+static HWQ_ATTR(ring_low_usec);
+
+static struct attribute *hwq_dev_tx_attrs[] = {
+	&hwq_gate_mask_attribute.attr,
+	&hwq_burst_entries_attribute.attr,
+	&hwq_burst_bytes_attribute.attr,
+	&hwq_stq_burst_entries_attribute.attr,
+	&hwq_stq_burst_bytes_attribute.attr,
+	&hwq_ring_high_attribute.attr,
+	&hwq_ring_low_attribute.attr,
+	&hwq_ring_high_usec_attribute.attr,
+	&hwq_ring_low_usec_attribute.attr,
+	NULL,
+};
+
+static struct attribute_group hwq_dev_tx_group = {
+	.attrs = hwq_dev_tx_attrs,
+};
+
 /* hwq statistics */
 #define HWQ_STATS_SHOW_U64(_name) \
 static ssize_t hwq_stats_##_name##_show(struct device *dev, \
@@ -291,6 +547,15 @@ static ssize_t hwq_stats_##_name##_show(struct device *dev, \
 	return snprintf(page, PAGE_SIZE - 1, "%llu\n", tmp); \
 }
 
+#define HWQ_DSTATS_SHOW_U64(_name) \
+static ssize_t hwq_stats_##_name##_show(struct device *dev, \
+		struct device_attribute *attr, char *page) \
+{ \
+	struct hwqueue_info *hwq = dev_get_drvdata(dev); \
+\
+	return snprintf(page, PAGE_SIZE - 1, "%llu\n", hwq->dstats._name); \
+}
+
 #define HWQ_STATS_ATTR_RO(_name) \
 struct device_attribute hwq_stats_##_name##_attribute = { \
 	.attr	= { .name = __stringify(_name), .mode = 0444 }, \
@@ -303,6 +568,8 @@ HWQ_STATS_SHOW_U64(rx_bytes);
 HWQ_STATS_SHOW_U64(tx_bytes);
 HWQ_STATS_SHOW_U64(rx_errors);
 HWQ_STATS_SHOW_U64(tx_errors);
+HWQ_DSTATS_SHOW_U64(poll_hits);
+HWQ_DSTATS_SHOW_U64(poll_misses);
 
 static HWQ_STATS_ATTR_RO(rx_packets);
 static HWQ_STATS_ATTR_RO(tx_packets);
@@ -310,6 +577,8 @@ static HWQ_STATS_ATTR_RO(rx_bytes);
 static HWQ_STATS_ATTR_RO(tx_bytes);
 static HWQ_STATS_ATTR_RO(rx_errors);
 static HWQ_STATS_ATTR_RO(tx_errors);
+static HWQ_STATS_ATTR_RO(poll_hits);
+static HWQ_STATS_ATTR_RO(poll_misses);
 
 static struct attribute *hwq_dev_stat_attrs[] = {
 	&hwq_stats_rx_packets_attribute.attr,
@@ -318,6 +587,8 @@ static struct attribute *hwq_dev_stat_attrs[] = {
 	&hwq_stats_tx_bytes_attribute.attr,
 	&hwq_stats_rx_errors_attribute.attr,
 	&hwq_stats_tx_errors_attribute.attr,
+	&hwq_stats_poll_hits_attribute.attr,
+	&hwq_stats_poll_misses_attribute.attr,
 	NULL,
 };
 
@@ -335,6 +606,7 @@ const struct attribute_group *hwq_sysfs_groups_rx[] = {
 
 const struct attribute_group *hwq_sysfs_groups_tx[] = {
 	&hwq_dev_basic_group,
+	&hwq_dev_tx_group,
 	&hwq_dev_stat_group,
 	NULL,
 };
@@ -409,6 +681,7 @@ static ssize_t stq_state_show(struct stqueue_info *stq,
 
 STQ_SHOW_INT(index);
 STQ_SHOW_INT(qno);
+STQ_SHOW_INT(priority);
 
 static ssize_t stq_cbs_params_show(struct stqueue_info *stq,
 				   struct stq_attribute *attr,
@@ -438,6 +711,7 @@ static STQ_ATTR_RO(state);
 static STQ_ATTR_RO(qno);
 /* for Tx stream */
 static STQ_ATTR_RO(cbs_params);
+static STQ_ATTR_RO(priority);
 
 struct attribute *stq_default_attrs_rx[] = {
 	&stq_index_attribute.attr,
@@ -451,6 +725,25 @@ struct attribute *stq_default_attrs_tx[] = {
 	&stq_state_attribute.attr,
 	&stq_qno_attribute.attr,
 	&stq_cbs_params_attribute.attr,
+	&stq_priority_attribute.attr,
+	NULL,
+};
+
+static const struct attribute_group stq_default_group_rx = {
+	.attrs = stq_default_attrs_rx,
+};
+
+static const struct attribute_group stq_default_group_tx = {
+	.attrs = stq_default_attrs_tx,
+};
+
+const struct attribute_group *stq_default_groups_rx[] = {
+	&stq_default_group_rx,
+	NULL,
+};
+
+const struct attribute_group *stq_default_groups_tx[] = {
+	&stq_default_group_tx,
 	NULL,
 };
 
@@ -461,6 +754,13 @@ static ssize_t stq_stats_##_name##_show(struct stqueue_info *stq, \
 	return snprintf(page, PAGE_SIZE - 1, "%llu\n", stq->pstats._name); \
 }
 
+#define STQ_DSTATS_SHOW_U64(_name) \
+static ssize_t stq_stats_##_name##_show(struct stqueue_info *stq, \
+			   struct stq_attribute *attr, char *page) \
+{ \
+	return snprintf(page, PAGE_SIZE - 1, "%llu\n", stq->dstats._name); \
+}
+
 #define STQ_STATS_ATTR_RO(_name) \
 struct stq_attribute stq_stats_##_name##_attribute = { \
 	.attr	= { .name = __stringify(_name), .mode = 0444 }, \
@@ -473,6 +773,11 @@ STQ_STATS_SHOW_U64(rx_bytes);
 STQ_STATS_SHOW_U64(tx_bytes);
 STQ_STATS_SHOW_U64(rx_errors);
 STQ_STATS_SHOW_U64(tx_errors);
+STQ_DSTATS_SHOW_U64(cachesync_ranges);
+STQ_DSTATS_SHOW_U64(cachesync_calls);
+STQ_DSTATS_SHOW_U64(starved);
+STQ_DSTATS_SHOW_U64(deadline_misses);
+STQ_DSTATS_SHOW_U64(nonconforming);
 
 static STQ_STATS_ATTR_RO(rx_packets);
 static STQ_STATS_ATTR_RO(tx_packets);
@@ -480,6 +785,11 @@ static STQ_STATS_ATTR_RO(rx_bytes);
 static STQ_STATS_ATTR_RO(tx_bytes);
 static STQ_STATS_ATTR_RO(rx_errors);
 static STQ_STATS_ATTR_RO(tx_errors);
+static STQ_STATS_ATTR_RO(cachesync_ranges);
+static STQ_STATS_ATTR_RO(cachesync_calls);
+static STQ_STATS_ATTR_RO(starved);
+static STQ_STATS_ATTR_RO(deadline_misses);
+static STQ_STATS_ATTR_RO(nonconforming);
 
 static struct attribute *stq_dev_stat_attrs[] = {
 	&stq_stats_rx_packets_attribute.attr,
@@ -488,6 +798,11 @@ static struct attribute *stq_dev_stat_attrs[] = {
 	&stq_stats_tx_bytes_attribute.attr,
 	&stq_stats_rx_errors_attribute.attr,
 	&stq_stats_tx_errors_attribute.attr,
+	&stq_stats_cachesync_ranges_attribute.attr,
+	&stq_stats_cachesync_calls_attribute.attr,
+	&stq_stats_starved_attribute.attr,
+	&stq_stats_deadline_misses_attribute.attr,
+	&stq_stats_nonconforming_attribute.attr,
 	NULL,
 };
 
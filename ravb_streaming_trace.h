@@ -111,7 +111,9 @@ TRACE_EVENT(avb_state,
 		{ 0x0000010, "txint" }, \
 		{ 0x0000020, "rxint" }, \
 		{ 0x0000040, "timeout" }, \
-		{ 0x0000100, "unload" })
+		{ 0x0000080, "launch" }, \
+		{ 0x0000100, "unload" }, \
+		{ 0x0000200, "gate" })
 
 TRACE_EVENT(avb_event,
 	TP_PROTO(s32 index, enum AVB_STATE state,